@@ -1,6 +1,16 @@
 #include <cstdio>
+#include <cstring>
 #include <algorithm>
 #include <iostream>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #include <SDL.h>
 #include <SDL_ttf.h>
@@ -8,15 +18,177 @@
 #define SCREEN_WIDTH 640
 #define SCREEN_HEIGHT 480
 
-int menu(void* ptr);
-void menu_points(uint32_t pixels[][SCREEN_WIDTH]);
-void menu_line(uint32_t pixels[][SCREEN_WIDTH]);
-void menu_circle(uint32_t pixels[][SCREEN_WIDTH]);
+#define SPAN_CACHE_SIZE 32
+
+#define MASK_WORDS (SCREEN_WIDTH / 64)
+
+// Transforms work in 24.8 fixed point, 256 units to a pixel, and round to whole pixels at the end
+typedef int32_t fixed;
+
+#define FIXED_SHIFT 8
+#define FIXED_ONE (1 << FIXED_SHIFT)
+#define FIXED_HALF (FIXED_ONE / 2)
+
+// Largest coordinate that can be entered, in pixels. Leaves room in 24.8 fixed point for the sum
+// of two coordinates, such as a point moved by a translation.
+#define COORD_MAX ((1 << 20) - 1)
+
+// The half-width of the rows j0 to j1 of an ellipse centred on (0, 0). Ellipses that fit on the
+// screen keep every row, taller ones only keep the rows that are on the screen, so the table is
+// never taller than the screen.
+struct EllipseSpans {
+    int width;
+    int height;
+    int j0;
+    int j1;
+    unsigned int last_used;
+    std::vector<int> half_widths;
+};
+
+enum PrimitiveType {
+    PRIM_LINE,
+    PRIM_ELLIPSE
+};
+
+// How a color is combined with the pixel under it, weighted by the color's alpha
+enum BlendMode {
+    BLEND_SOURCE_OVER,
+    BLEND_ADDITIVE,
+    BLEND_MULTIPLY
+};
+
+// Something to draw, kept until the whole batch is drawn. Lines go from (x1, y1) to (x2, y2),
+// ellipses are centred on (x1, y1) and are x2 wide and y2 high.
+struct Primitive {
+    PrimitiveType type;
+    int x1;
+    int y1;
+    int x2;
+    int y2;
+    int color;
+    BlendMode mode;
+};
+
+// Every blend mode works out each channel as min(d * m / 255 + p, 255), where d is the pixel
+// under it. m and p are packed the same way as an RGBA8888 color.
+struct BlendFactors {
+    uint32_t m;
+    uint32_t p;
+};
+
+// One bit per pixel, set once something has been drawn on the pixel. Each assignment is a single
+// file, so the mask, plot_point and fill_span are copied in A3/main.cpp. Keep the two in step.
+struct CoverageMask {
+    uint64_t bits[SCREEN_HEIGHT][MASK_WORDS];
+};
+
+// The formats the canvas can be stored in. Colors are always given as RGBA8888 and encoded
+// into a pixel once per primitive, so the drawing loops only copy pixels. Everything that
+// touches the canvas is a template on the format, there's no check of the format per pixel.
+struct FormatRGBA8888 {
+    typedef uint32_t pixel;
+    static const Uint32 surface_format = SDL_PIXELFORMAT_RGBA8888;
+    static const Uint32 texture_format = SDL_PIXELFORMAT_RGBA8888;
+
+    static pixel encode(uint32_t color);
+    static void reset();
+    static void upload(SDL_Texture* texture, const SDL_Surface* canvas);
+
+    struct Blender {
+        BlendFactors factors;
+
+        void init(BlendFactors f);
+        void blend(pixel* dst, int count) const;
+    };
+};
+
+// 5 bits of red, 6 of green and 5 of blue, half the memory of RGBA8888
+struct FormatRGB565 {
+    typedef uint16_t pixel;
+    static const Uint32 surface_format = SDL_PIXELFORMAT_RGB565;
+    static const Uint32 texture_format = SDL_PIXELFORMAT_RGB565;
+
+    static pixel encode(uint32_t color);
+    static uint32_t decode(pixel p);
+    static void reset();
+    static void upload(SDL_Texture* texture, const SDL_Surface* canvas);
+
+    // Pixels are widened to RGBA8888 a chunk at a time so they can be blended together
+    struct Blender {
+        BlendFactors factors;
+
+        void init(BlendFactors f);
+        void blend(pixel* dst, int count) const;
+    };
+};
+
+// An index into a palette of up to 256 colors, a quarter of the memory of RGBA8888. The
+// palette is refilled every time the canvas is redrawn and expanded to RGBA8888 on upload.
+struct FormatIndexed8 {
+    typedef uint8_t pixel;
+    static const Uint32 surface_format = SDL_PIXELFORMAT_INDEX8;
+    static const Uint32 texture_format = SDL_PIXELFORMAT_RGBA8888;
+
+    static uint32_t palette[256];
+    static int palette_size;
+
+    static pixel encode(uint32_t color);
+    static void reset();
+    static void upload(SDL_Texture* texture, const SDL_Surface* canvas);
+
+    // Blending one color over every pixel with the same index gives the same result, so each
+    // palette entry is blended once and the pixels are looked up in a table
+    struct Blender {
+        pixel remap[256];
+
+        void init(BlendFactors f);
+        void blend(pixel* dst, int count) const;
+    };
+};
+
+// How one primitive is written to a canvas in the format F, made just before it's drawn. An
+// opaque color drawn with source-over replaces the pixels, anything else is blended.
+template<typename F>
+struct Brush {
+    bool opaque;
+    typename F::pixel pixel;
+    typename F::Blender blender;
+
+    Brush(uint32_t color, BlendMode mode);
+    explicit Brush(typename F::pixel replace);
+
+    void write(typename F::pixel* dst, int count) const;
+};
+
+template<typename F> int run(SDL_Renderer* renderer);
+
+template<typename F> int menu(void* ptr);
+template<typename F> void menu_points(typename F::pixel pixels[][SCREEN_WIDTH]);
+template<typename F> void menu_line(typename F::pixel pixels[][SCREEN_WIDTH]);
+template<typename F> void menu_circle(typename F::pixel pixels[][SCREEN_WIDTH]);
+void menu_culling();
+void menu_blend();
+
+template<typename F> void clear(typename F::pixel pixels[][SCREEN_WIDTH]);
+void rotate(fixed p[2], float angle);
+fixed to_fixed(int v);
+int clamp_coord(int v);
+int fixed_round(fixed v);
+template<typename F> void draw_line(typename F::pixel pixels[][SCREEN_WIDTH], int x1, int y1, int x2, int y2, const Brush<F>& brush, CoverageMask* mask = NULL, bool cover = true);
+template<typename F> void draw_ellipse(typename F::pixel pixels[][SCREEN_WIDTH], int x, int y, int width, int height, const Brush<F>& brush, CoverageMask* mask = NULL, bool cover = true);
+const EllipseSpans& ellipse_spans(int width, int height, int j0, int j1);
+
+template<typename F> void plot_point(typename F::pixel pixels[][SCREEN_WIDTH], int x, int y, const Brush<F>& brush, CoverageMask* mask, bool cover);
+template<typename F> void fill_span(typename F::pixel pixels[][SCREEN_WIDTH], int y, int x0, int x1, const Brush<F>& brush, CoverageMask* mask, bool cover);
+int lowest_bit(uint64_t v);
+template<typename F> void draw_primitive(typename F::pixel pixels[][SCREEN_WIDTH], const Primitive& prim, CoverageMask* mask, bool cover);
+template<typename F> void draw_batch(typename F::pixel pixels[][SCREEN_WIDTH]);
 
-void clear(uint32_t pixels[][SCREEN_WIDTH]);
-void rotate(int p[2], float angle);
-void draw_line(uint32_t pixels[][SCREEN_WIDTH], int x1, int y1, int x2, int y2, int color);
-void draw_ellipse(uint32_t pixels[][SCREEN_WIDTH], int x, int y, int width, int height, int color);
+bool is_opaque(uint32_t color, BlendMode mode);
+BlendFactors blend_factors(uint32_t color, BlendMode mode);
+uint32_t blend_color(uint32_t dst, BlendFactors f);
+void blend_span(uint32_t* dst, int count, BlendFactors f);
+uint32_t div255(uint32_t x);
 
 // Will handle the stdin in another thread, if we don't the window will not 
 // update on Arch Linux. We will use a mutex to guard against reads/writes of 
@@ -26,6 +198,16 @@ SDL_mutex* mutex = NULL;
 bool dirty = false;
 bool running = true;
 
+// Lines and circles are collected into a batch and drawn together. With occlusion culling the
+// batch is drawn front to back and pixels already covered are skipped, so each pixel is only
+// written once. Only used by the input thread.
+std::vector<Primitive> batch;
+bool occlusion_culling = false;
+CoverageMask coverage_mask;
+
+// How new points, lines and circles are blended with what's under them
+BlendMode blend_mode = BLEND_SOURCE_OVER;
+
 int main(int argc, char* args[]) {
     // Initialize SDL
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
@@ -54,23 +236,52 @@ int main(int argc, char* args[]) {
         return 1;
     }
 
+    // The format of the canvas can be picked on the command line, the drawing code is
+    // compiled separately for each one
+    const char* format = argc > 1 ? args[1] : "rgba8888";
+    int ret;
+    if (strcmp(format, "rgba8888") == 0) {
+        ret = run<FormatRGBA8888>(renderer);
+    } else if (strcmp(format, "rgb565") == 0) {
+        ret = run<FormatRGB565>(renderer);
+    } else if (strcmp(format, "indexed8") == 0) {
+        ret = run<FormatIndexed8>(renderer);
+    } else {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "unknown pixel format %s, use rgba8888, rgb565 or indexed8\n", format);
+        ret = 1;
+    }
+
+    // Cleanup
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window); 
+
+    SDL_Quit();
+
+    return ret;
+}
+
+// Draw on a canvas in the format F until the user ends the program
+template<typename F>
+int run(SDL_Renderer* renderer) {
     // Create a canvas that can be painted on
-    SDL_Surface* canvas = SDL_CreateRGBSurfaceWithFormat(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, SDL_PIXELFORMAT_RGBA8888);
+    SDL_Surface* canvas = SDL_CreateRGBSurfaceWithFormat(0, SCREEN_WIDTH, SCREEN_HEIGHT, 8 * sizeof(typename F::pixel), F::surface_format);
     if (canvas == NULL) {
         SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "could not create surface: %s\n", SDL_GetError());
         return 1;
     }
 
     // Create a texture that can be rendered on the GPU
-    SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+    SDL_Texture* texture = SDL_CreateTexture(renderer, F::texture_format, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
     if (texture == NULL) {
         SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "could not create texture: %s\n", SDL_GetError());
         return 1;
     }
 
+    F::reset();
+
     //
     // We will start input in a second thread so it does not interfere with rendering.
-    input_thread = SDL_CreateThread(menu, "MenuThread", canvas);
+    input_thread = SDL_CreateThread(menu<F>, "MenuThread", canvas);
     if (input_thread == NULL) {
         SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "could not create input thread: %s\n", SDL_GetError());
         return 1;
@@ -107,7 +318,7 @@ int main(int argc, char* args[]) {
 
             if (dirty) {
                 // Render our drawing to the texture
-                SDL_UpdateTexture(texture, NULL, canvas->pixels, canvas->pitch);
+                F::upload(texture, canvas);
                 dirty = false;
             }
 
@@ -128,22 +339,20 @@ int main(int argc, char* args[]) {
 
     SDL_DestroyTexture(texture);
     SDL_FreeSurface(canvas);
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window); 
-
-    SDL_Quit();
 
     return 0;
 }
 
+template<typename F>
 int menu(void* ptr) {
+    typedef typename F::pixel pixel;
     SDL_Surface* canvas = (SDL_Surface*) ptr;
-    uint32_t (*pixels)[SCREEN_WIDTH] = (uint32_t(*)[SCREEN_WIDTH]) canvas->pixels;
+    pixel (*pixels)[SCREEN_WIDTH] = (pixel(*)[SCREEN_WIDTH]) canvas->pixels;
 
     int option;
 
     while(true) {
-        printf("Menu\n 1) End Program\n 2) Draw Points\n 3) Draw Line\n 4) Draw Circle\n");
+        printf("Menu\n 1) End Program\n 2) Draw Points\n 3) Draw Line\n 4) Draw Circle\n 5) Occlusion Culling\n 6) Blend Mode\n");
         scanf("%d", &option);
 
         switch (option) {
@@ -154,13 +363,19 @@ int menu(void* ptr) {
                 SDL_UnlockMutex(mutex);
                 return 0;
             case 2:
-                menu_points(pixels);
+                menu_points<F>(pixels);
                 break;
             case 3:
-                menu_line(pixels);
+                menu_line<F>(pixels);
                 break;
             case 4:
-                menu_circle(pixels);
+                menu_circle<F>(pixels);
+                break;
+            case 5:
+                menu_culling();
+                break;
+            case 6:
+                menu_blend();
                 break;
             default:
                 printf("Invalid menu option. Please specify an actual menu item.\n");
@@ -171,7 +386,8 @@ int menu(void* ptr) {
     return 0;
 }
 
-void menu_points(uint32_t pixels[][SCREEN_WIDTH]) {
+template<typename F>
+void menu_points(typename F::pixel pixels[][SCREEN_WIDTH]) {
     int num_points = 0;
     while(num_points < 1 || num_points > 5) {
         printf("Specify number of points (1-5) > ");
@@ -188,14 +404,15 @@ void menu_points(uint32_t pixels[][SCREEN_WIDTH]) {
     SDL_LockMutex(mutex);
 
     // Clear the screen
-    clear(pixels);
+    clear<F>(pixels);
     
     // Draw the points
     for(int i = 0; i < num_points; i++) {
         int* p = &points[i][0];
         // Make sure the point is on the screen before drawing it
         if((p[1] >= 0 && p[1] < SCREEN_HEIGHT) && (p[0] >= 0 && p[0] < SCREEN_WIDTH)) {
-            pixels[p[1]][p[0]] = p[2];
+            const Brush<F> brush(p[2], blend_mode);
+            brush.write(&pixels[p[1]][p[0]], 1);
         }
     }
 
@@ -205,7 +422,8 @@ void menu_points(uint32_t pixels[][SCREEN_WIDTH]) {
     SDL_UnlockMutex(mutex);
 }
 
-void menu_line(uint32_t pixels[][SCREEN_WIDTH]) {
+template<typename F>
+void menu_line(typename F::pixel pixels[][SCREEN_WIDTH]) {
     int a[2], b[2], color;
     printf("Specify line (x1 y1 x2 y2 color) > ");
     scanf("%d %d %d %d %x", &a[0], &a[1], &b[0], &b[1], &color);
@@ -214,6 +432,11 @@ void menu_line(uint32_t pixels[][SCREEN_WIDTH]) {
     printf("Specify a translation (trans_x trans_y) > ");
     scanf("%d %d", &trans_x, &trans_y);
 
+    // Keep the points and their translations within fixed point
+    for(int* v : { &a[0], &a[1], &b[0], &b[1], &trans_x, &trans_y }) {
+        *v = clamp_coord(*v);
+    }
+
     int deg;
     printf("Specify an angle in degrees (angle) > ");
     scanf("%d", &deg);
@@ -223,58 +446,59 @@ void menu_line(uint32_t pixels[][SCREEN_WIDTH]) {
 
     printf("angle in radians %f\n", angle);
 
-    // Draw, making sure to lock and unlock the mutex
-    SDL_LockMutex(mutex);
-
-    //
-    // Clear the screen
-    //
-    clear(pixels);
-
     //
     // Draw the main line segment
     //
-    draw_line(
-        pixels,
+    batch.push_back(Primitive {
+        PRIM_LINE,
         a[0],
         a[1],
         b[0],
         b[1],
-        color
-    );
+        color,
+        blend_mode
+    });
 
     //
     // Draw the translated line segment
     //
-    draw_line(
-        pixels,
+    batch.push_back(Primitive {
+        PRIM_LINE,
         a[0] + trans_x,
         a[1] + trans_y,
         b[0] + trans_x,
         b[1] + trans_y,
-        color
-    );
+        color,
+        blend_mode
+    });
 
     //
     // Draw the rotated line segment
     //
-    // Find the midpoint
-    int mid[2] = { (a[0] + b[0]) / 2, (a[1] + b[1]) / 2 };
+    // Find the midpoint, in fixed point so it can fall between pixels
+    fixed mid[2] = { (to_fixed(a[0]) + to_fixed(b[0])) / 2, (to_fixed(a[1]) + to_fixed(b[1])) / 2 };
     // Set the positions of a and b at the midpoint
-    int a_rot[2] = { a[0] - mid[0],	a[1] - mid[1] };
-    int b_rot[2] = { b[0] - mid[0],	b[1] - mid[1] };
+    fixed a_rot[2] = { to_fixed(a[0]) - mid[0], to_fixed(a[1]) - mid[1] };
+    fixed b_rot[2] = { to_fixed(b[0]) - mid[0], to_fixed(b[1]) - mid[1] };
     // Rotate about the midpoint
     rotate(a_rot, angle);
     rotate(b_rot, angle);
-    // Draw the line, adding the midpoints back to the points
-    draw_line(
-        pixels,
-        a_rot[0] + mid[0],
-        a_rot[1] + mid[1],
-        b_rot[0] + mid[0],
-        b_rot[1] + mid[1],
-        color
-    );
+    // Draw the line, adding the midpoints back to the points and rounding to whole pixels
+    batch.push_back(Primitive {
+        PRIM_LINE,
+        fixed_round(a_rot[0] + mid[0]),
+        fixed_round(a_rot[1] + mid[1]),
+        fixed_round(b_rot[0] + mid[0]),
+        fixed_round(b_rot[1] + mid[1]),
+        color,
+        blend_mode
+    });
+
+    // Draw, making sure to lock and unlock the mutex
+    SDL_LockMutex(mutex);
+
+    // Clear the screen and draw the lines
+    draw_batch<F>(pixels);
 
     // Tell the main thread that we have changed the canvas
     dirty = true;
@@ -282,7 +506,8 @@ void menu_line(uint32_t pixels[][SCREEN_WIDTH]) {
     SDL_UnlockMutex(mutex);
 }
 
-void menu_circle(uint32_t pixels[][SCREEN_WIDTH]) {
+template<typename F>
+void menu_circle(typename F::pixel pixels[][SCREEN_WIDTH]) {
     int x, y, radius, color;
     printf("Specify circle (x y radius color) > ");
     scanf("%d %d %d %x", &x, &y, &radius, &color);
@@ -294,17 +519,22 @@ void menu_circle(uint32_t pixels[][SCREEN_WIDTH]) {
     int scale_x, scale_y;
     printf("Specify a scale (scale_x scale_y) > ");
     scanf("%d %d", &scale_x, &scale_y);
-    
-    // Draw, making sure to lock and unlock the mutex
-    SDL_LockMutex(mutex);
 
-    // Clear the screen
-    clear(pixels);
+    // Keep the sums below from overflowing
+    for(int* v : { &x, &y, &radius, &trans_x, &trans_y, &scale_x, &scale_y }) {
+        *v = clamp_coord(*v);
+    }
 
     // Draw the 3 circles with the different properties
-    draw_ellipse(pixels, x, y, radius, radius, color);
-    draw_ellipse(pixels, x + trans_x, y + trans_y, radius, radius, color);
-    draw_ellipse(pixels, x, y, radius + scale_x, radius + scale_y, color);
+    batch.push_back(Primitive { PRIM_ELLIPSE, x, y, radius, radius, color, blend_mode });
+    batch.push_back(Primitive { PRIM_ELLIPSE, x + trans_x, y + trans_y, radius, radius, color, blend_mode });
+    batch.push_back(Primitive { PRIM_ELLIPSE, x, y, radius + scale_x, radius + scale_y, color, blend_mode });
+
+    // Draw, making sure to lock and unlock the mutex
+    SDL_LockMutex(mutex);
+
+    // Clear the screen and draw the circles
+    draw_batch<F>(pixels);
 
     // Tell the main thread that we have changed the canvas
     dirty = true;
@@ -312,65 +542,556 @@ void menu_circle(uint32_t pixels[][SCREEN_WIDTH]) {
     SDL_UnlockMutex(mutex);
 }
 
-// Helper function to rotate a point by an angle
-void rotate(int p[2], float angle) {
-    int rot_x = (int) (cos(angle) * p[0] - sin(angle) * p[1]);
-    int rot_y = (int) (sin(angle) * p[0] + cos(angle) * p[1]);
-    p[0] = rot_x;
-    p[1] = rot_y;
+void menu_culling() {
+    occlusion_culling = !occlusion_culling;
+    printf("Occlusion culling %s\n", occlusion_culling ? "on" : "off");
+}
+
+void menu_blend() {
+    int mode = 0;
+    while(mode < 1 || mode > 3) {
+        printf("Blend mode:\n1) Source Over\n2) Additive\n3) Multiply\n");
+        if(scanf("%d", &mode) != 1)
+            return;
+    }
+
+    blend_mode = (BlendMode) (mode - 1);
+}
+
+// Helper function to rotate a fixed point by an angle. The sine and cosine are 16.16 fixed
+// point and the products are 64 bit, the result is rounded rather than truncated.
+void rotate(fixed p[2], float angle) {
+    const int64_t c = llround(cos(angle) * 65536.0);
+    const int64_t s = llround(sin(angle) * 65536.0);
+    const int64_t rot_x = c * p[0] - s * p[1];
+    const int64_t rot_y = s * p[0] + c * p[1];
+    p[0] = (fixed) ((rot_x + 32768) >> 16);
+    p[1] = (fixed) ((rot_y + 32768) >> 16);
+}
+
+// v must be within COORD_MAX, anything larger doesn't fit in 24.8 fixed point
+fixed to_fixed(int v) {
+    return v * FIXED_ONE;
+}
+
+int clamp_coord(int v) {
+    return std::min(std::max(v, -COORD_MAX), COORD_MAX);
+}
+
+// Nearest whole pixel, halfway rounds up
+int fixed_round(fixed v) {
+    return (v + FIXED_HALF) >> FIXED_SHIFT;
 }
 
 // Loop through all the pixels on the screen and set them to black
-void clear(uint32_t pixels[][SCREEN_WIDTH]) {
+template<typename F>
+void clear(typename F::pixel pixels[][SCREEN_WIDTH]) {
+    F::reset();
+
+    const typename F::pixel black = F::encode(0x00000000);
     for(int y = 0; y < SCREEN_HEIGHT; y++) {
         for(int x = 0; x < SCREEN_WIDTH; x++) {
-            pixels[y][x] = 0x00000000;
+            pixels[y][x] = black;
         }
     }
 }
 
-// Helper function to draw an ellipse
-void draw_ellipse(uint32_t pixels[][SCREEN_WIDTH], int x, int y, int width, int height, int color) {
-    for(int j = -height; j <= height; j++) {
-        for(int i = -width; i <= width; i++) {
-            // We check that this pixel is inside of the ellipse
-            if(i * i * height * height + j * j * width * width <= height * height * width * width) {
-                // Check to make sure we don't write off of the screen.
-                if((y + j >= 0 && y + j < SCREEN_HEIGHT) && (x + i >= 0 && x + i < SCREEN_WIDTH)) {
-                    pixels[y + j][x + i] = color;
-                }
-            }
+// Recently drawn ellipse shapes, the least recently used one is replaced when it's full
+EllipseSpans span_cache[SPAN_CACHE_SIZE];
+int span_cache_count = 0;
+unsigned int span_cache_clock = 0;
+
+// Find the spans of at least rows j0 to j1 of an ellipse, working them out if they aren't cached.
+// A shape that fits on the screen is cached whole, so the same marker cut off by the top or the
+// bottom of the screen shares one entry. Only taller shapes have the rows as part of the key.
+const EllipseSpans& ellipse_spans(int width, int height, int j0, int j1) {
+    span_cache_clock++;
+
+    if(2 * height + 1 <= SCREEN_HEIGHT) {
+        j0 = -height;
+        j1 = height;
+    }
+
+    int lru = 0;
+    for(int i = 0; i < span_cache_count; i++) {
+        EllipseSpans& spans = span_cache[i];
+        if(spans.width == width && spans.height == height && spans.j0 == j0 && spans.j1 == j1) {
+            spans.last_used = span_cache_clock;
+            return spans;
+        }
+
+        if(spans.last_used < span_cache[lru].last_used)
+            lru = i;
+    }
+
+    EllipseSpans& spans = span_cache[span_cache_count < SPAN_CACHE_SIZE ? span_cache_count++ : lru];
+    spans.width = width;
+    spans.height = height;
+    spans.j0 = j0;
+    spans.j1 = j1;
+    spans.last_used = span_cache_clock;
+    spans.half_widths.resize(j1 - j0 + 1);
+
+    // The widest i on each row with i^2 * h^2 + j^2 * w^2 <= h^2 * w^2, the same test as
+    // checking every pixel. Start from the exact answer and fix up any rounding. The test only
+    // fits in 64 bits while w * h < 2^31, bigger shapes keep the rounded answer.
+    const int64_t w2 = (int64_t) width * width;
+    const int64_t h2 = (int64_t) height * height;
+    const bool exact = (int64_t) width * height < ((int64_t) 1 << 31);
+    for(int j = j0; j <= j1; j++) {
+        int i = height == 0 ? width : (int) (width * sqrt(1.0 - (double) j * j / h2));
+
+        if(exact) {
+            int64_t limit = h2 * w2 - (int64_t) j * j * w2;
+
+            while(i < width && (int64_t) (i + 1) * (i + 1) * h2 <= limit)
+                i++;
+            while(i > 0 && (int64_t) i * i * h2 > limit)
+                i--;
         }
+
+        spans.half_widths[j - j0] = i;
+    }
+
+    return spans;
+}
+
+// Helper function to draw an ellipse
+// Each row is a single span, the spans come from a cache so drawing the same shape again
+// only has to fill them.
+template<typename F>
+void draw_ellipse(typename F::pixel pixels[][SCREEN_WIDTH], int x, int y, int width, int height, const Brush<F>& brush, CoverageMask* mask, bool cover) {
+    if(width < 0 || height < 0)
+        return;
+
+    // Only the rows on the screen
+    const int j0 = std::max(-height, -y);
+    const int j1 = std::min(height, SCREEN_HEIGHT - 1 - y);
+    if(j0 > j1)
+        return;
+
+    const EllipseSpans& spans = ellipse_spans(width, height, j0, j1);
+
+    for(int j = j0; j <= j1; j++) {
+        const int half = spans.half_widths[j - spans.j0];
+
+        // Check to make sure we don't write off of the screen.
+        const int x0 = std::max(x - half, 0);
+        const int x1 = std::min(x + half, SCREEN_WIDTH - 1);
+
+        if(x0 <= x1)
+            fill_span(pixels, y + j, x0, x1, brush, mask, cover);
     }
 }
 
 // Helper function to draw a simple line segment
-void draw_line(uint32_t pixels[][SCREEN_WIDTH], int x1, int y1, int x2, int y2, int color) {
-    if(x2 < x1) {
-        std::swap(x2, x1);
-        std::swap(y2, y1);
+template<typename F>
+void draw_line(typename F::pixel pixels[][SCREEN_WIDTH], int x1, int y1, int x2, int y2, const Brush<F>& brush, CoverageMask* mask, bool cover) {
+    // Bresenham, the error term is an integer so there's no slope to round. Steps along
+    // whichever axis the line is longer in, so steep lines don't leave gaps.
+    const int dx = abs(x2 - x1);
+    const int dy = -abs(y2 - y1);
+    const int step_x = x1 < x2 ? 1 : -1;
+    const int step_y = y1 < y2 ? 1 : -1;
+    int error = dx + dy;
+
+    while(true) {
+        plot_point(pixels, x1, y1, brush, mask, cover);
+
+        if(x1 == x2 && y1 == y2)
+            break;
+
+        const int e2 = 2 * error;
+        if(e2 >= dy) {
+            error += dy;
+            x1 += step_x;
+        }
+        if(e2 <= dx) {
+            error += dx;
+            y1 += step_y;
+        }
     }
+}
 
-    // 90 degree line, slope of 0
-    if(x1 == x2) {
-        if(y1 > y2)
-            std::swap(y1, y2);
+// Helper function to make sure we're only writing to pixels on the screen. With a mask the
+// pixel is only written if nothing has covered it yet, and is marked as covered if cover is set.
+template<typename F>
+void plot_point(typename F::pixel pixels[][SCREEN_WIDTH], int x, int y, const Brush<F>& brush, CoverageMask* mask, bool cover) {
+    if((y < 0 || y >= SCREEN_HEIGHT) || (x < 0 || x >= SCREEN_WIDTH))
+        return;
 
-        for(int y = y1; y < y2; y++) {
-            if((y >= 0 && y < SCREEN_HEIGHT) && (x1 >= 0 && x1 < SCREEN_WIDTH)) {
-                pixels[y][x1] = color;
-            }
+    if(mask != NULL) {
+        uint64_t& word = mask->bits[y][x / 64];
+        uint64_t bit = (uint64_t) 1 << (x % 64);
+
+        if(word & bit)
+            return;
+
+        if(cover)
+            word |= bit;
+    }
+
+    brush.write(&pixels[y][x], 1);
+}
+
+// Fill the pixels from x0 to x1 (inclusive) on a row, they must be on the screen. With a mask
+// only the pixels nothing has covered yet are written, 64 pixels at a time, and they're marked
+// as covered if cover is set.
+template<typename F>
+void fill_span(typename F::pixel pixels[][SCREEN_WIDTH], int y, int x0, int x1, const Brush<F>& brush, CoverageMask* mask, bool cover) {
+    if(mask == NULL) {
+        brush.write(&pixels[y][x0], x1 - x0 + 1);
+        return;
+    }
+
+    for(int w = x0 / 64; w <= x1 / 64; w++) {
+        const int start = std::max(x0, w * 64);
+        const int end = std::min(x1, w * 64 + 63);
+
+        // Bits for the part of the span in this word that hasn't been covered
+        uint64_t span = (~(uint64_t) 0 >> (63 - (end - start))) << (start % 64);
+        uint64_t todo = span & ~mask->bits[y][w];
+
+        if(todo == 0)
+            continue;
+
+        if(cover)
+            mask->bits[y][w] |= todo;
+
+        // Write each run of uncovered pixels in one go
+        while(todo != 0) {
+            const int first = lowest_bit(todo);
+            const uint64_t rest = ~(todo >> first);
+            const int length = rest == 0 ? 64 - first : lowest_bit(rest);
+
+            brush.write(&pixels[y][w * 64 + first], length);
+
+            // Adding the lowest bit of the run carries through it and clears it
+            todo &= todo + (todo & (~todo + 1));
         }
+    }
+}
+
+// Index of the lowest set bit, v must not be 0
+int lowest_bit(uint64_t v) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, v);
+    return (int) index;
+#else
+    return __builtin_ctzll(v);
+#endif
+}
+
+// Draw a line or an ellipse with its own color and blend mode
+template<typename F>
+void draw_primitive(typename F::pixel pixels[][SCREEN_WIDTH], const Primitive& prim, CoverageMask* mask, bool cover) {
+    const Brush<F> brush(prim.color, prim.mode);
+
+    if(prim.type == PRIM_LINE) {
+        draw_line(pixels, prim.x1, prim.y1, prim.x2, prim.y2, brush, mask, cover);
     } else {
-        int m = (y2 - y1) / (x2 - x1);
-        int c = y2 - m * x2;
-
-        for(int x = x1; x <= x2; x++) {
-            int y = m * x + c;
-            // Make sure the point is on the screen before drawing it
-            if((y >= 0 && y < SCREEN_HEIGHT) && (x >= 0 && x < SCREEN_WIDTH)) {
-                pixels[y][x] = color;
+        draw_ellipse(pixels, prim.x1, prim.y1, prim.x2, prim.y2, brush, mask, cover);
+    }
+}
+
+// Clear the screen and draw everything in the batch, then empty it
+// MUST BE USED WHEN THE MUTEX IS LOCKED
+template<typename F>
+void draw_batch(typename F::pixel pixels[][SCREEN_WIDTH]) {
+    if(!occlusion_culling) {
+        clear<F>(pixels);
+
+        for(auto& prim : batch) {
+            draw_primitive<F>(pixels, prim, NULL, true);
+        }
+
+        batch.clear();
+        return;
+    }
+
+    // Every pixel is about to be redrawn, so the palette can start again
+    F::reset();
+
+    // Only opaque primitives hide what's behind them. The opaque primitives after the last one
+    // that blends are drawn from the back of the batch to the front, each one can only write
+    // to pixels that nothing in front of it has covered.
+    int front = (int) batch.size();
+    while(front > 0 && is_opaque(batch[front - 1].color, batch[front - 1].mode))
+        front--;
+
+    for(int i = (int) batch.size() - 1; i >= front; i--) {
+        draw_primitive<F>(pixels, batch[i], &coverage_mask, true);
+    }
+
+    // The background and the primitives that are blended, or under one that is, are drawn in
+    // order underneath. They only write to pixels the front primitives didn't cover.
+    const Brush<F> background(F::encode(0x00000000));
+    for(int y = 0; y < SCREEN_HEIGHT; y++) {
+        fill_span(pixels, y, 0, SCREEN_WIDTH - 1, background, &coverage_mask, false);
+    }
+
+    for(int i = 0; i < front; i++) {
+        draw_primitive<F>(pixels, batch[i], &coverage_mask, false);
+    }
+
+    // Reset the mask for the next batch
+    for(int y = 0; y < SCREEN_HEIGHT; y++) {
+        std::fill(coverage_mask.bits[y], coverage_mask.bits[y] + MASK_WORDS, 0);
+    }
+
+    batch.clear();
+}
+
+//
+// Pixel formats
+//
+
+FormatRGBA8888::pixel FormatRGBA8888::encode(uint32_t color) {
+    return color;
+}
+
+void FormatRGBA8888::reset() {
+}
+
+// MUST BE USED WHEN THE MUTEX IS LOCKED
+void FormatRGBA8888::upload(SDL_Texture* texture, const SDL_Surface* canvas) {
+    SDL_UpdateTexture(texture, NULL, canvas->pixels, canvas->pitch);
+}
+
+void FormatRGBA8888::Blender::init(BlendFactors f) {
+    factors = f;
+}
+
+void FormatRGBA8888::Blender::blend(pixel* dst, int count) const {
+    blend_span(dst, count, factors);
+}
+
+// Keep the top bits of each channel, the alpha is dropped
+FormatRGB565::pixel FormatRGB565::encode(uint32_t color) {
+    const uint32_t r = (color >> 24) & 0xFF;
+    const uint32_t g = (color >> 16) & 0xFF;
+    const uint32_t b = (color >> 8) & 0xFF;
+    return (pixel) (((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+}
+
+// Widen each channel back to 8 bits by repeating its top bits, the alpha is opaque
+uint32_t FormatRGB565::decode(pixel p) {
+    const uint32_t r = (p >> 11) & 0x1F;
+    const uint32_t g = (p >> 5) & 0x3F;
+    const uint32_t b = p & 0x1F;
+    return ((r << 3 | r >> 2) << 24) | ((g << 2 | g >> 4) << 16) | ((b << 3 | b >> 2) << 8) | 0xFF;
+}
+
+void FormatRGB565::reset() {
+}
+
+// MUST BE USED WHEN THE MUTEX IS LOCKED
+void FormatRGB565::upload(SDL_Texture* texture, const SDL_Surface* canvas) {
+    SDL_UpdateTexture(texture, NULL, canvas->pixels, canvas->pitch);
+}
+
+void FormatRGB565::Blender::init(BlendFactors f) {
+    factors = f;
+}
+
+void FormatRGB565::Blender::blend(pixel* dst, int count) const {
+    uint32_t wide[64];
+
+    for(int start = 0; start < count; start += 64) {
+        const int n = std::min(count - start, 64);
+
+        for(int i = 0; i < n; i++)
+            wide[i] = decode(dst[start + i]);
+
+        blend_span(wide, n, factors);
+
+        for(int i = 0; i < n; i++)
+            dst[start + i] = encode(wide[i]);
+    }
+}
+
+uint32_t FormatIndexed8::palette[256];
+int FormatIndexed8::palette_size = 0;
+
+// Find the color in the palette, adding it if there's room. Once the palette is full the
+// closest color is used instead.
+FormatIndexed8::pixel FormatIndexed8::encode(uint32_t color) {
+    int closest = 0;
+    int closest_distance = INT32_MAX;
+
+    for(int i = 0; i < palette_size; i++) {
+        if(palette[i] == color)
+            return (pixel) i;
+
+        int distance = 0;
+        for(int shift = 8; shift < 32; shift += 8) {
+            const int d = (int) ((palette[i] >> shift) & 0xFF) - (int) ((color >> shift) & 0xFF);
+            distance += d * d;
+        }
+
+        if(distance < closest_distance) {
+            closest = i;
+            closest_distance = distance;
+        }
+    }
+
+    if(palette_size < 256) {
+        palette[palette_size] = color;
+        return (pixel) palette_size++;
+    }
+
+    return (pixel) closest;
+}
+
+// Only black is left, as index 0
+void FormatIndexed8::reset() {
+    palette[0] = 0x00000000;
+    palette_size = 1;
+}
+
+// Expand every index to its color as it's copied into the texture
+// MUST BE USED WHEN THE MUTEX IS LOCKED
+void FormatIndexed8::upload(SDL_Texture* texture, const SDL_Surface* canvas) {
+    void* dst;
+    int pitch;
+    if(SDL_LockTexture(texture, NULL, &dst, &pitch) < 0)
+        return;
+
+    for(int y = 0; y < SCREEN_HEIGHT; y++) {
+        const pixel* src_row = (const pixel*) ((const char*) canvas->pixels + y * canvas->pitch);
+        uint32_t* dst_row = (uint32_t*) ((char*) dst + y * pitch);
+
+        for(int x = 0; x < SCREEN_WIDTH; x++) {
+            dst_row[x] = palette[src_row[x]];
+        }
+    }
+
+    SDL_UnlockTexture(texture);
+}
+
+// Only the entries already in the palette can be on the canvas, blending may add more. The rest
+// of the table is never used but is zeroed so it never holds garbage.
+void FormatIndexed8::Blender::init(BlendFactors f) {
+    const int size = palette_size;
+    for(int i = 0; i < size; i++) {
+        remap[i] = encode(blend_color(palette[i], f));
+    }
+    std::fill(remap + size, remap + 256, 0);
+}
+
+void FormatIndexed8::Blender::blend(pixel* dst, int count) const {
+    for(int i = 0; i < count; i++) {
+        dst[i] = remap[dst[i]];
+    }
+}
+
+//
+// Blending
+//
+
+template<typename F>
+Brush<F>::Brush(uint32_t color, BlendMode mode) : opaque(is_opaque(color, mode)) {
+    if(opaque) {
+        pixel = F::encode(color);
+    } else {
+        blender.init(blend_factors(color, mode));
+    }
+}
+
+// A brush that replaces pixels no matter what the alpha is, for clearing
+template<typename F>
+Brush<F>::Brush(typename F::pixel replace) : opaque(true), pixel(replace) {
+}
+
+template<typename F>
+void Brush<F>::write(typename F::pixel* dst, int count) const {
+    if(opaque) {
+        std::fill(dst, dst + count, pixel);
+    } else {
+        blender.blend(dst, count);
+    }
+}
+
+// Whether the color completely hides what's under it
+bool is_opaque(uint32_t color, BlendMode mode) {
+    return mode == BLEND_SOURCE_OVER && (color & 0xFF) == 0xFF;
+}
+
+// Work out m and p for a color and mode. The alpha channel is blended as if the color had 255
+// in it, apart from multiply which leaves it alone.
+BlendFactors blend_factors(uint32_t color, BlendMode mode) {
+    const uint32_t a = color & 0xFF;
+
+    // The color weighted by its alpha
+    uint32_t weighted = a;
+    for(int shift = 8; shift < 32; shift += 8) {
+        weighted |= div255(((color >> shift) & 0xFF) * a) << shift;
+    }
+
+    switch(mode) {
+        case BLEND_ADDITIVE:
+            return BlendFactors { 0xFFFFFFFF, weighted };
+        case BLEND_MULTIPLY: {
+            // Multiply by the color where it's opaque and by 1 where it's transparent
+            uint32_t m = 0xFF;
+            for(int shift = 8; shift < 32; shift += 8) {
+                m |= (((weighted >> shift) & 0xFF) + 255 - a) << shift;
             }
+            return BlendFactors { m, 0 };
         }
+        default:
+            return BlendFactors { (255 - a) * 0x01010101, weighted };
     }
-}
\ No newline at end of file
+}
+
+// Blend one RGBA8888 pixel
+uint32_t blend_color(uint32_t dst, BlendFactors f) {
+    uint32_t out = 0;
+    for(int shift = 0; shift < 32; shift += 8) {
+        const uint32_t d = (dst >> shift) & 0xFF;
+        const uint32_t m = (f.m >> shift) & 0xFF;
+        const uint32_t p = (f.p >> shift) & 0xFF;
+        out |= std::min(div255(d * m) + p, (uint32_t) 255) << shift;
+    }
+
+    return out;
+}
+
+// Blend a span of RGBA8888 pixels. With SSE2 the channels of 4 pixels are blended together as
+// 16 bit lanes, anything left over is blended one pixel at a time.
+void blend_span(uint32_t* dst, int count, BlendFactors f) {
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i m = _mm_unpacklo_epi8(_mm_set1_epi32((int) f.m), zero);
+    const __m128i p = _mm_unpacklo_epi8(_mm_set1_epi32((int) f.p), zero);
+    const __m128i half = _mm_set1_epi16(128);
+
+    for(; i + 4 <= count; i += 4) {
+        const __m128i d = _mm_loadu_si128((const __m128i*) (dst + i));
+
+        // d * m fits in 16 bits, then divide by 255 the same way as div255
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), m), half);
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), m), half);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+        // Packing back to bytes clamps to 255
+        lo = _mm_add_epi16(lo, p);
+        hi = _mm_add_epi16(hi, p);
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+
+    for(; i < count; i++) {
+        dst[i] = blend_color(dst[i], f);
+    }
+}
+
+// x / 255 rounded to the nearest integer, for x up to 255 * 255
+uint32_t div255(uint32_t x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
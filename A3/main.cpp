@@ -1,50 +1,398 @@
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
 #include <algorithm>
 #include <iostream>
+#include <list>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+#include <dirent.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #include <SDL.h>
 #include <SDL_ttf.h>
 
 #define SCREEN_WIDTH 640
 #define SCREEN_HEIGHT 480
 
+#define TILE_SIZE 64
+#define TILE_CACHE_SIZE 256
+
+// Shapes are found by the squares of the world they overlap, WORLD_BUCKET_SHIFT is the size of a
+// square in fixed point (2^16 is 256 pixels). A shape covering more than WORLD_BUCKET_LIMIT
+// squares is checked by every tile instead.
+#define WORLD_BUCKET_SHIFT 16
+#define WORLD_BUCKET_LIMIT 256
+
+#define QUEUE_SIZE 64
+
+#define MASK_WORDS (SCREEN_WIDTH / 64)
+
+// How long the render thread draws before letting the main thread show the result (ms)
+#define FRAME_BUDGET 8
+
+// The SSE2 path in draw_triangle writes a block row as two vectors of 4 pixels
+#define BLOCK_SIZE 8
+
+// A large triangle fill is split into bands at least a block tall, one per thread
+#define FILL_THREADS_MAX (SCREEN_HEIGHT / BLOCK_SIZE)
+
+// Coordinates are 24.8 fixed point, 256 units to a pixel. Pixel (x, y) is at (x << 8, y << 8).
+typedef int32_t fixed;
+
+#define FIXED_SHIFT 8
+#define FIXED_ONE (1 << FIXED_SHIFT)
+#define FIXED_HALF (FIXED_ONE / 2)
+
+// Largest coordinate that can be entered, in pixels. Leaves room in 24.8 fixed point for the sum
+// of two coordinates, such as a vertex translated by a starting point.
+#define COORD_MAX ((1 << 20) - 1)
+
+// A vertex, with sub-pixel precision
 struct Point {
+    fixed x;
+    fixed y;
+};
+
+// A whole pixel on the screen
+struct Pixel {
     int x;
     int y;
 };
 
-int menu(void* ptr);
+// Bump allocator for scratch memory that only lives for one menu command. Everything is freed
+// at once by reset(), which also merges the blocks so the next command fits in a single block.
+struct Arena {
+    std::vector<char*> blocks;
+    char* head = NULL;
+    char* end = NULL;
+    size_t capacity = 0;
+
+    Arena() {}
+    Arena(const Arena&) = delete;
+    ~Arena();
 
-void menu_clip(uint32_t pixels[][SCREEN_WIDTH]);
-void menu_fill(uint32_t pixels[][SCREEN_WIDTH]);
+    void* allocate(size_t bytes, size_t align);
+    void reset();
+};
 
-std::vector<Point> menu_polygon();
+// Lets standard containers take their memory from an arena, freeing is left to Arena::reset()
+template <typename T>
+struct ArenaAllocator {
+    typedef T value_type;
 
-void sutherland_hodgman(std::vector<Point>& verts, const std::vector<Point>& clipper);
-void liang_barksy(std::vector<Point>& verts);
+    Arena* arena;
 
-void draw_floodfill(uint32_t pixels[][SCREEN_WIDTH], int x, int y, uint32_t color);
-void draw_scanline(uint32_t pixels[][SCREEN_WIDTH], const std::vector<Point>& verts, uint32_t color);
+    ArenaAllocator(Arena* a) : arena(a) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        return (T*) arena->allocate(n * sizeof(T), alignof(T));
+    }
+
+    void deallocate(T*, size_t) {}
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena == b.arena;
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena != b.arena;
+}
+
+template <typename T>
+using Scratch = std::vector<T, ArenaAllocator<T>>;
+
+typedef Scratch<Point> Polygon;
+
+struct Triangle {
+    Point a;
+    Point b;
+    Point c;
+};
+
+enum FillRule {
+    EVEN_ODD,
+    NON_ZERO
+};
+
+// A filled polygon in world coordinates, with its bounding box
+struct Shape {
+    std::vector<Point> verts;
+    uint32_t color;
+    Point min;
+    Point max;
+};
+
+// The part of the world on the screen. Zoom levels are powers of sqrt(2), the position is the
+// top left corner of the screen in zoomed pixels so panning moves by whole pixels.
+struct View {
+    int zoom;
+    int x;
+    int y;
+};
+
+enum CommandType {
+    CMD_QUIT,
+    CMD_CLIP,
+    CMD_FLOODFILL,
+    CMD_SCANLINE,
+    CMD_TRIANGLES,
+    CMD_FILL_RULE,
+    CMD_WORLD,
+    CMD_CULLING
+};
+
+// A menu option read by the input thread, waiting to be drawn by the render thread. Each
+// command has its own arena for its polygon so the two threads never share one.
+struct Command {
+    CommandType type;
+    Arena arena;
+    Polygon verts;
+    Point a;
+    Point b;
+    int option;
+    bool antialias;
+    uint32_t color;
+
+    Command() : type(CMD_QUIT), verts(&arena) {}
+};
+
+// A flood fill in progress, the stack holds the pixels still to be visited
+struct FloodFill {
+    uint32_t color;
+    Scratch<Pixel> stack;
+};
+
+// A scan-line fill in progress, y is the next row to draw
+struct Scanline {
+    const Polygon* verts;
+    uint32_t color;
+    int y;
+    int max_y;
+    Scratch<int> v;
+};
+
+// One bit per pixel, set once something has been drawn on the pixel. Each assignment is a single
+// file, so the mask, plot_point and fill_span are copied in A2/main.cpp. Keep the two in step.
+struct CoverageMask {
+    uint64_t bits[SCREEN_HEIGHT][MASK_WORDS];
+};
+
+struct CommandQueue {
+    Command commands[QUEUE_SIZE];
+    // Index of the next command to run, only written by the render thread
+    SDL_atomic_t head;
+    // Index of the next free slot, only written by the input thread
+    SDL_atomic_t tail;
+};
+
+struct Tile {
+    int zoom;
+    int tx;
+    int ty;
+    uint32_t pixels[TILE_SIZE * TILE_SIZE];
+};
+
+// Work given to each thread when filling in parallel, every thread owns a band of rows
+struct TriangleBand {
+    uint32_t (*pixels)[SCREEN_WIDTH];
+    const Scratch<Triangle>* tris;
+    uint32_t color;
+    int y0;
+    int y1;
+};
+
+struct FillPool;
+
+// A thread that fills one band at a time, it sleeps on start until it's given a band
+struct FillWorker {
+    FillPool* pool;
+    SDL_Thread* thread;
+    SDL_sem* start;
+    TriangleBand band;
+};
+
+// Threads that large triangle fills are split between. They're started once by the render thread
+// and wait for work, so a fill doesn't start threads or allocate memory. Job workers have none.
+struct FillPool {
+    int count;
+    bool quit;
+    // Posted by each worker when its band is done
+    SDL_sem* done;
+    FillWorker workers[FILL_THREADS_MAX - 1];
+
+    FillPool() : count(0), quit(false), done(NULL) {}
+};
 
-void plot_point(uint32_t pixels[][SCREEN_WIDTH], int x, int y, uint32_t color);
-void draw_line(uint32_t pixels[][SCREEN_WIDTH], Point p0, Point p1, uint32_t color);
-void draw_polygon(uint32_t pixels[][SCREEN_WIDTH], const std::vector<Point>& verts, uint32_t color);
+// What drawing commands needs besides the canvas. The render thread has one, and so does each
+// worker in job mode, so workers never share scratch memory.
+struct RenderContext {
+    // Scratch memory for the command being drawn, reset after every command
+    Arena arena;
+    // With occlusion culling Clip draws its polygons front to back and skips pixels that are
+    // already covered, so each pixel is only written once
+    bool occlusion_culling;
+    CoverageMask coverage_mask;
+    // The render thread draws long fills in slices and sends World to the world view, job
+    // workers draw everything straight onto their canvas
+    bool interactive;
+    // Threads draw_triangles can split a large polygon between
+    FillPool fill_pool;
+
+    RenderContext(bool interactive) : occlusion_culling(false), coverage_mask(), interactive(interactive), fill_pool() {}
+};
+
+// A scene script drawn in job mode, and how long it took
+struct Job {
+    std::string script;
+    std::string image;
+    double ms;
+    bool ok;
+};
+
+struct JobList {
+    std::vector<Job> jobs;
+    // Index of the next job to start, workers take jobs until it passes the end
+    SDL_atomic_t next;
+};
+
+int menu(void* ptr);
+int render(void* ptr);
+
+bool menu_clip();
+bool menu_fill();
+bool menu_fill_rule();
+bool menu_world();
+void menu_culling();
+
+bool menu_polygon(Polygon& points);
+bool menu_point(Point& p);
+bool menu_confirm();
+
+Command* queue_reserve(CommandType type);
+void reset_command(Command& cmd);
+void queue_publish();
+bool run_command(RenderContext& ctx, uint32_t pixels[][SCREEN_WIDTH], const Command& cmd);
+bool next_slice();
+
+int run_jobs(const char* scenes, const char* output, int workers);
+bool list_jobs(JobList& list, const std::string& scenes, const std::string& output);
+int job_worker(void* ptr);
+bool draw_scene(RenderContext& ctx, uint32_t pixels[][SCREEN_WIDTH], Command& cmd, FILE* in);
+bool scene_polygon(FILE* in, Polygon& points);
+bool scene_point(FILE* in, Point& p);
+bool scene_confirm(FILE* in);
+
+void sutherland_hodgman(Polygon& verts, const std::vector<Point>& clipper);
+void liang_barksy(Polygon& verts);
+
+void draw_floodfill(uint32_t pixels[][SCREEN_WIDTH], int x, int y, uint32_t color);
+void draw_scanline(uint32_t pixels[][SCREEN_WIDTH], const Polygon& verts, uint32_t color);
+
+void floodfill_start(FloodFill& fill, int x, int y, uint32_t color);
+bool floodfill_step(uint32_t pixels[][SCREEN_WIDTH], FloodFill& fill, Uint64 deadline);
+void scanline_start(Scanline& scan, const Polygon& verts, uint32_t color);
+bool scanline_step(uint32_t pixels[][SCREEN_WIDTH], Scanline& scan, Uint64 deadline);
+
+Scratch<Triangle> triangulate(const Polygon& verts);
+void fill_pool_start(FillPool& pool, int threads);
+void fill_pool_stop(FillPool& pool);
+int fill_worker(void* ptr);
+void draw_triangles(uint32_t pixels[][SCREEN_WIDTH], const Scratch<Triangle>& tris, uint32_t color, FillPool& pool);
+void draw_triangle(uint32_t pixels[][SCREEN_WIDTH], Triangle tri, uint32_t color, int band_y0, int band_y1);
+
+void draw_coverage(uint32_t pixels[][SCREEN_WIDTH], const Polygon& verts, uint32_t color, FillRule rule, bool antialias);
+
+float view_scale(int zoom);
+void pan_view(int dx, int dy);
+void zoom_view(int steps);
+void draw_world(uint32_t pixels[][SCREEN_WIDTH]);
+Shape make_shape(const Polygon& verts, uint32_t color);
+void index_shape(int i);
+int world_bucket(float v);
+bool shape_on_tile(const Shape& shape, int zoom, int tx, int ty);
+
+void plot_point(uint32_t pixels[][SCREEN_WIDTH], int x, int y, uint32_t color, CoverageMask* mask = NULL);
+void fill_span(uint32_t pixels[][SCREEN_WIDTH], int y, int x0, int x1, uint32_t color, CoverageMask* mask);
+int lowest_bit(uint64_t v);
+void draw_line(uint32_t pixels[][SCREEN_WIDTH], Point p0, Point p1, uint32_t color, CoverageMask* mask = NULL);
+void draw_polygon(uint32_t pixels[][SCREEN_WIDTH], const Polygon& verts, uint32_t color, CoverageMask* mask = NULL);
 void clear(uint32_t pixels[][SCREEN_WIDTH]);
 
-std::vector<Point> translate_polygon(const std::vector<Point>& verts, Point p);
+Polygon translate_polygon(const Polygon& verts, Point p);
+
+fixed to_fixed(int v);
+Point input_point(int x, int y);
+int fixed_round(fixed v);
+fixed fixed_lerp(fixed a, fixed b, int64_t num, int64_t den);
+float to_float(fixed v);
 
 // Will handle the stdin in another thread, if we don't the window will not 
 // update on Arch Linux. We will use a mutex to guard against reads/writes of 
 // the running and dirty flag.
 SDL_Thread* input_thread = NULL;
+// Draws the commands the input thread reads so reading can run ahead of drawing
+SDL_Thread* render_thread = NULL;
+CommandQueue queue;
 SDL_mutex* mutex = NULL;
 bool dirty = false;
 bool running = true;
 
+// The world is only drawn when the last menu option was World. The shapes are appended by the
+// render thread when it runs a World command and guarded by the mutex, the view and the tiles
+// belong to the main thread.
+std::vector<Shape> world;
+bool world_view = false;
+bool world_changed = false;
+bool view_changed = false;
+View view { 0, 0, 0 };
+
+// Only used by the render thread
+RenderContext render_context(true);
+
+// The render thread draws until slice_end, then lets the main thread show the canvas. Commands
+// queued after batch_tail that clear the canvas cancel any long fill that is still being drawn.
+Uint64 slice_end = 0;
+int batch_tail = 0;
+
 int main(int argc, char* args[]) {
+    // Job mode draws a list of scene scripts to images, it doesn't need a window
+    if(argc > 1 && strcmp(args[1], "--jobs") == 0) {
+        if(argc < 4) {
+            printf("Usage: %s --jobs <scene directory or manifest> <output directory> [workers]\n", args[0]);
+            return 1;
+        }
+
+        // No subsystems, but threads, surfaces and timers still expect SDL to be set up
+        if (SDL_Init(0) < 0) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "could not initialize sdl2: %s\n", SDL_GetError());
+            return 1;
+        }
+
+        int result = run_jobs(args[2], args[3], argc > 4 ? atoi(args[4]) : SDL_GetCPUCount());
+
+        SDL_Quit();
+
+        return result;
+    }
+
     // Initialize SDL
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "could not initialize sdl2: %s\n", SDL_GetError());
@@ -87,16 +435,24 @@ int main(int argc, char* args[]) {
     }
 
     //
+    // The mutex must exist before the threads that use it start
+    mutex = SDL_CreateMutex();
+    if (mutex == NULL) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "could not create mutex: %s\n", SDL_GetError());
+        return 1;
+    }
+
     // We will start input in a second thread so it does not interfere with rendering.
-    input_thread = SDL_CreateThread(menu, "MenuThread", canvas);
+    input_thread = SDL_CreateThread(menu, "MenuThread", NULL);
     if (input_thread == NULL) {
         SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "could not create input thread: %s\n", SDL_GetError());
         return 1;
     }
 
-    mutex = SDL_CreateMutex();
-    if (mutex == NULL) {
-        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "could not create mutex: %s\n", SDL_GetError());
+    // Commands are drawn in a third thread so input can be read while drawing.
+    render_thread = SDL_CreateThread(render, "RenderThread", canvas);
+    if (render_thread == NULL) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "could not create render thread: %s\n", SDL_GetError());
         return 1;
     }
     //
@@ -111,6 +467,29 @@ int main(int argc, char* args[]) {
                     // Normally we would handle the exit but this is messy when using the terminal input
                     // is_running = false;
                     break;
+                case SDL_KEYDOWN:
+                    // Arrow keys pan the world, + and - zoom in and out
+                    switch(event.key.keysym.sym) {
+                        case SDLK_LEFT:     pan_view(-TILE_SIZE / 2, 0); break;
+                        case SDLK_RIGHT:    pan_view(TILE_SIZE / 2, 0); break;
+                        case SDLK_UP:       pan_view(0, -TILE_SIZE / 2); break;
+                        case SDLK_DOWN:     pan_view(0, TILE_SIZE / 2); break;
+                        case SDLK_EQUALS:
+                        case SDLK_PLUS:
+                        case SDLK_KP_PLUS:  zoom_view(1); break;
+                        case SDLK_MINUS:
+                        case SDLK_KP_MINUS: zoom_view(-1); break;
+                    }
+                    break;
+                case SDL_MOUSEMOTION:
+                    // Drag the world around with the left mouse button
+                    if(event.motion.state & SDL_BUTTON_LMASK) {
+                        pan_view(-event.motion.xrel, -event.motion.yrel);
+                    }
+                    break;
+                case SDL_MOUSEWHEEL:
+                    zoom_view(event.wheel.y > 0 ? 1 : -1);
+                    break;
             }
         }
 
@@ -120,9 +499,16 @@ int main(int argc, char* args[]) {
         // data to the texture to be rendered.
         if (SDL_TryLockMutex(mutex) == 0) {
             if (!running) {
+                SDL_UnlockMutex(mutex);
                 break;
             }
 
+            if (world_view && (world_changed || view_changed)) {
+                // Compose the visible tiles onto the canvas
+                draw_world((uint32_t(*)[SCREEN_WIDTH]) canvas->pixels);
+                dirty = true;
+            }
+
             if (dirty) {
                 // Render our drawing to the texture
                 SDL_UpdateTexture(texture, NULL, canvas->pixels, canvas->pitch);
@@ -137,9 +523,10 @@ int main(int argc, char* args[]) {
         SDL_RenderPresent(renderer);
     }
 
-    // Wait for the input thread to stop.
+    // Wait for the input and render threads to stop.
     int ret;
     SDL_WaitThread(input_thread, &ret);
+    SDL_WaitThread(render_thread, &ret);
 
     // Cleanup
     SDL_DestroyMutex(mutex);
@@ -155,159 +542,184 @@ int main(int argc, char* args[]) {
 }
 
 int menu(void* ptr) {
-    SDL_Surface* canvas = (SDL_Surface*) ptr;
-    uint32_t (*pixels)[SCREEN_WIDTH] = (uint32_t(*)[SCREEN_WIDTH]) canvas->pixels;
-
     int option;
 
     while(true) {
-        printf("Menu\n 1) End Program\n 2) Clip\n 3) Fill\n");
-        scanf("%d", &option);
+        printf("Menu\n 1) End Program\n 2) Clip\n 3) Fill\n 4) Fill Rule\n 5) World\n 6) Occlusion Culling\n");
 
-        switch (option) {
-            case 1:
-                // To end the program we will tell the main thread that we're done 
-                SDL_LockMutex(mutex);
-                running = false;
-                SDL_UnlockMutex(mutex);
-                return 0;
-            case 2:
-                menu_clip(pixels);
-                break;
-            case 3:
-                menu_fill(pixels);
-                break;
-            default:
-                printf("Invalid menu option. Please specify an actual menu item.\n");
-                break;
+        // Running out of piped input, or input that isn't a number, ends the program
+        bool reading = scanf("%d", &option) == 1;
+
+        if(reading) {
+            switch (option) {
+                case 1:
+                    reading = false;
+                    break;
+                case 2:
+                    reading = menu_clip();
+                    break;
+                case 3:
+                    reading = menu_fill();
+                    break;
+                case 4:
+                    reading = menu_fill_rule();
+                    break;
+                case 5:
+                    reading = menu_world();
+                    break;
+                case 6:
+                    menu_culling();
+                    break;
+                default:
+                    printf("Invalid menu option. Please specify an actual menu item.\n");
+                    break;
+            }
+        }
+
+        if(!reading) {
+            // To end the program we will tell the render thread that we're done, it will
+            // finish the commands before this one first. A command that was cut short was
+            // never published, so this takes its slot.
+            queue_reserve(CMD_QUIT);
+            queue_publish();
+            return 0;
         }
     }
 
     return 0;
 }
 
-void menu_clip(uint32_t pixels[][SCREEN_WIDTH]) {
-    const std::vector<Point> clipper {
-        Point { 0, 0 },
-        Point { 0, SCREEN_HEIGHT - 1 },
-        Point { SCREEN_WIDTH - 1, SCREEN_HEIGHT - 1 },
-        Point { SCREEN_WIDTH - 1, 0 }
-    };
+// The menu options return false if the input ran out before the option was finished
 
+bool menu_clip() {
     // Get input from the user
-    std::vector<Point> verts = menu_polygon();
+    Command* cmd = queue_reserve(CMD_CLIP);
+    if(!menu_polygon(cmd->verts))
+        return false;
 
-    int start_x0, start_y0;
     printf("Enter a starting point (x y) > ");
-    scanf("%d %d", &start_x0, &start_y0);
+    if(!menu_point(cmd->a))
+        return false;
 
-    int start_x1, start_y1;
     printf("Enter a second starting point (x y) > ");
-    scanf("%d %d", &start_x1, &start_y1);
+    if(!menu_point(cmd->b))
+        return false;
 
-    int option;
     while(true) {
         printf("Clipping algorithm:\n1) Sutherland-Hodgman\n2) Liang-Barsky\n");
-        scanf("%d", &option);
+        if(scanf("%d", &cmd->option) != 1)
+            return false;
 
-        if(option == 1 || option == 2) {
+        if(cmd->option == 1 || cmd->option == 2) {
             break;
         }
 
         printf("Invalid option.\n");
     }
 
-    std::vector<Point> first_poly = translate_polygon(verts, Point { start_x0, start_y0 });
-    std::vector<Point> second_poly = translate_polygon(verts, Point { start_y1, start_y1 });
-
-    // Draw, remembering to lock the mutex
-    SDL_LockMutex(mutex);
-    
-    // Clear the screen
-    clear(pixels);
-
-    if(option == 1) {
-        // Sutherlang-Hodgman
-        sutherland_hodgman(first_poly, clipper);
-        draw_polygon(pixels, first_poly, 0xFF000000);
-
-        sutherland_hodgman(second_poly, clipper);
-        draw_polygon(pixels, second_poly, 0x00FF0000);
-    } else if(option == 2) {
-        // Liang-Barsky
-
-        // TODO
-    }
-
-    // Tell the main thread we have changed the texture
-    dirty = true;
-
-    SDL_UnlockMutex(mutex);
+    queue_publish();
+    return true;
 }
 
-void menu_fill(uint32_t pixels[][SCREEN_WIDTH]) {
-    const std::vector<Point> clipper {
-        Point { 0, 0 },
-        Point { 0, SCREEN_HEIGHT - 1 },
-        Point { SCREEN_WIDTH - 1, SCREEN_HEIGHT - 1 },
-        Point { SCREEN_WIDTH - 1, 0 }
-    };
-
-    //
-
-    std::vector<Point> verts = menu_polygon();
-    sutherland_hodgman(verts, clipper); // Clip the polygon
+bool menu_fill() {
+    Command* flood = queue_reserve(CMD_FLOODFILL);
+    if(!menu_polygon(flood->verts))
+        return false;
 
-    int x, y;
     printf("Enter a point inside of the polygon (x y) > ");
-    scanf("%d %d", &x, &y);
+    if(!menu_point(flood->a))
+        return false;
+
+    // Flood fill is drawn while we wait for the user
+    queue_publish();
+
+    printf("Draw scanline algorithm? (y) > ");
+    if(!menu_confirm())
+        return false;
+
+    // Only this thread writes to a command's polygon, so it's safe to read the flood fill's
+    // polygon while the render thread is drawing it.
+    Command* scanline = queue_reserve(CMD_SCANLINE);
+    scanline->verts.assign(flood->verts.begin(), flood->verts.end());
+    queue_publish();
+
+    char answer;
+    printf("Draw triangle fill algorithm? (y/n) > ");
+    if(scanf(" %c", &answer) != 1)
+        return false;
+
+    // Anything but 'y' goes back to the menu
+    if(answer != 'y')
+        return true;
+
+    Command* triangles = queue_reserve(CMD_TRIANGLES);
+    triangles->verts.assign(scanline->verts.begin(), scanline->verts.end());
+    queue_publish();
+    return true;
+}
 
-    // Draw with Flood Fill
-    SDL_LockMutex(mutex);
+bool menu_fill_rule() {
+    Command* cmd = queue_reserve(CMD_FILL_RULE);
+    if(!menu_polygon(cmd->verts))
+        return false;
 
-    // Clear the screen
-    clear(pixels);
+    while(true) {
+        printf("Fill rule:\n1) Even-odd\n2) Non-zero\n");
+        if(scanf("%d", &cmd->option) != 1)
+            return false;
 
-    draw_polygon(pixels, verts, 0xFF000000);
-    draw_floodfill(pixels, x, y, 0xFF000000);
+        if(cmd->option == 1 || cmd->option == 2) {
+            break;
+        }
 
-    dirty = true;
+        printf("Invalid option.\n");
+    }
 
-    // We can be waiting for a while if the user doesn't hit a key so we'll unlock for now.
-    SDL_UnlockMutex(mutex);
+    char aa;
+    printf("Anti-alias? (y/n) > ");
+    if(scanf(" %c", &aa) != 1)
+        return false;
+    cmd->antialias = aa == 'y';
 
-    char cont;
-    while(true) {
-        printf("Draw scanline algorithm? (y) > ");
-        scanf("%c", &cont);
+    queue_publish();
+    return true;
+}
 
-        if(cont == 'y')
-            break;
-    }
+bool menu_world() {
+    // World coordinates aren't clipped to the screen, pan and zoom to see all of the shapes
+    Command* cmd = queue_reserve(CMD_WORLD);
+    if(!menu_polygon(cmd->verts))
+        return false;
 
-    // Draw with scan line
-    SDL_LockMutex(mutex);
+    printf("Enter a color (hex) > ");
+    if(scanf("%x", &cmd->color) != 1)
+        return false;
 
-    // Clear the screen
-    clear(pixels);
+    queue_publish();
+    return true;
+}
 
-    draw_scanline(pixels, verts, 0x00FF0000);
+void menu_culling() {
+    // The render thread has its own copy of the setting, this one is for the message
+    static bool culling = false;
+    culling = !culling;
 
-    dirty = true;
+    Command* cmd = queue_reserve(CMD_CULLING);
+    cmd->option = culling;
+    queue_publish();
 
-    // We can be waiting for a while if the user doesn't hit a key so we'll unlock for now.
-    SDL_UnlockMutex(mutex);
+    printf("Occlusion culling %s\n", culling ? "on" : "off");
 }
 
 // Helper function for getting a set of points (polygon) from stdin
 // This is used for both clipping, and filling.
-std::vector<Point> menu_polygon() {
-    std::vector<Point> points;
+bool menu_polygon(Polygon& points) {
     int n;
 
     while(true) {
         printf("Number of vertices ( > 2 ) > ");
-        scanf("%d", &n);
+        if(scanf("%d", &n) != 1)
+            return false;
 
         if(n > 2) {
             break;
@@ -318,178 +730,1645 @@ std::vector<Point> menu_polygon() {
 
     printf("Points in clockwise order:\n");
 
-    int x, y;
     for(int i = 0; i < n; i++) {
         printf("Enter point (x y) > ");
-        scanf("%d %d", &x, &y);
-        points.push_back(Point { x, y });
+
+        Point p;
+        if(!menu_point(p))
+            return false;
+        points.push_back(p);
     }
 
-    return points;
+    return true;
 }
 
-// 
-// Sutherland-Hodgman Algorithm
-// https://www.geeksforgeeks.org/polygon-clipping-sutherland-hodgman-algorithm-please-change-bmp-images-jpeg-png/
-
-// Returns x-value of point of intersectipn of two lines 
-int x_intersect(Point p0, Point p1, Point p2, Point p3) {
-    int num = (p0.x * p1.y - p0.y * p1.x) * (p2.x - p3.x) - (p0.x - p1.x) * (p2.x * p3.y - p2.y * p3.x); 
-    int den = (p0.x - p1.x) * (p2.y - p3.y) - (p0.y - p1.y) * (p2.x - p3.x);
-    return num / den;
-}
+bool menu_point(Point& p) {
+    int x, y;
+    if(scanf("%d %d", &x, &y) != 2)
+        return false;
 
-// Returns y-value of point of intersectipn of two lines 
-int y_intersect(Point p0, Point p1, Point p2, Point p3) { 
-    int num = (p0.x * p1.y - p0.y * p1.x) * (p2.y - p3.y) - (p0.y - p1.y) * (p2.x * p3.y - p2.y * p3.x); 
-    int den = (p0.x - p1.x) * (p2.y - p3.y) - (p0.y - p1.y) * (p2.x - p3.x); 
-    return num / den;
+    p = input_point(x, y);
+    return true;
 }
 
-void sh_clip(std::vector<Point>& verts, Point p0, Point p1) {
-    std::vector<Point> new_verts;
-
-    for(int i = 0; i < (int) verts.size(); i++) {
-        int k = (i + 1) % verts.size();
-        Point pi = verts[i];
-        Point pk = verts[k];
-
-        int i_pos = (p1.x - p0.x) * (pi.y - p0.y) - (p1.y - p0.y) * (pi.x - p0.x);
-        int k_pos = (p1.x - p0.x) * (pk.y - p0.y) - (p1.y - p0.y) * (pk.x - p0.x);
-
-        if(i_pos < 0 && k_pos < 0) {
+// Wait for a 'y', anything else is skipped
+bool menu_confirm() {
+    char cont;
+    while(scanf("%c", &cont) == 1) {
+        if(cont == 'y')
+            return true;
+    }
 
-            // Case 1: Both points are inside
-            new_verts.push_back(pk);
+    return false;
+}
 
-        } else if(i_pos >= 0 && k_pos < 0) {
-            
-            // Case 2: First point is outside
-            new_verts.push_back(Point {
-                x_intersect(p0, p1, pi, pk),
-                y_intersect(p0, p1, pi, pk)
-            });
+//
+// Command queue
+//
+// Single producer (the input thread), single consumer (the render thread). Each side only
+// writes its own index so no locking is needed. A slot belongs to the input thread from
+// queue_reserve() until queue_publish(), and to the render thread until it moves head past it.
 
-            new_verts.push_back(pk);
-            
-        } else if(i_pos < 0 && k_pos >= 0) {
-            // Case 3: Second point is outside
-            
-            new_verts.push_back(Point {
-                x_intersect(p0, p1, pi, pk),
-                y_intersect(p0, p1, pi, pk)
-            });
+// Wait for a free slot and start a new command in it
+Command* queue_reserve(CommandType type) {
+    int tail = SDL_AtomicGet(&queue.tail);
 
-        } else {
-            // Case 4: Both are outside, do nothing
-        }
+    // The render thread is behind, wait for it to free a slot
+    while(tail - SDL_AtomicGet(&queue.head) >= QUEUE_SIZE) {
+        SDL_Delay(1);
     }
 
-    verts = new_verts;
+    Command* cmd = &queue.commands[tail % QUEUE_SIZE];
+    reset_command(*cmd);
+    cmd->type = type;
+    return cmd;
 }
 
-void sutherland_hodgman(std::vector<Point>& verts, const std::vector<Point>& clipper) {
-    for(int i = 0; i < (int) clipper.size(); i++) {
-        int k = (i + 1) % clipper.size();
-        sh_clip(verts, clipper[i], clipper[k]);
-    }
+// Empty a command so it can be used again. The polygon gives up its memory before the arena is
+// reset, otherwise it would grow into memory that the arena hands out again.
+void reset_command(Command& cmd) {
+    cmd.verts = Polygon(&cmd.arena);
+    cmd.arena.reset();
 }
 
-//
-// Liang-Barsky Algorithm
-//
-void liangBarsky(float xmin, float ymin, float xmax, float ymax, Point pi, Point pk) {
+// Hand the reserved command to the render thread
+void queue_publish() {
+    SDL_AtomicAdd(&queue.tail, 1);
 }
 
-//
-// Flood Fill
-//
-// MUST BE USED WHEN THE MUTEX IS LOCKED
-void draw_floodfill(uint32_t pixels[][SCREEN_WIDTH], int x, int y, uint32_t color) {
-    // Check to make sure we aren't accidentally writing to memory outside of the screen if
-    // for some reason we break free from the polygon
-    if((x <= 0 || x >= SCREEN_WIDTH) || (y <= 0 || y >= SCREEN_HEIGHT))
-        return;
-
-    if(pixels[y][x] == color)
-        return;
-    
-    pixels[y][x] = color;
-
-    draw_floodfill(pixels, x, y - 1, color);
-    draw_floodfill(pixels, x, y + 1, color);
-    draw_floodfill(pixels, x - 1, y, color);
-    draw_floodfill(pixels, x + 1, y, color);
+// Commands that start by clearing the canvas hide everything drawn before them
+bool clears_canvas(CommandType type) {
+    return type != CMD_QUIT && type != CMD_WORLD && type != CMD_CULLING;
 }
 
-//
-// Scan-line algorithm
-//
+// Run one command, returns false once the program should stop
 // MUST BE USED WHEN THE MUTEX IS LOCKED
-void draw_scanline(uint32_t pixels[][SCREEN_WIDTH], const std::vector<Point>& verts, uint32_t color) {
-    int min_y = verts[0].y;
-    int max_y = verts[0].y;
-
-    for(auto& vert : verts) {
-        if(vert.y < min_y) {
-            min_y = vert.y;
-        }
+bool run_command(RenderContext& ctx, uint32_t pixels[][SCREEN_WIDTH], const Command& cmd) {
+    static const std::vector<Point> clipper {
+        Point { to_fixed(0), to_fixed(0) },
+        Point { to_fixed(0), to_fixed(SCREEN_HEIGHT - 1) },
+        Point { to_fixed(SCREEN_WIDTH - 1), to_fixed(SCREEN_HEIGHT - 1) },
+        Point { to_fixed(SCREEN_WIDTH - 1), to_fixed(0) }
+    };
 
-        if(vert.y > max_y) {
-            max_y = vert.y;
-        }
-    }
+    // With occlusion culling Clip fills the background itself once the polygons are drawn
+    const bool culling = ctx.occlusion_culling && cmd.type == CMD_CLIP;
 
-    //
-    SDL_LockMutex(mutex);
+    if(clears_canvas(cmd.type)) {
+        // Every command but World draws straight onto the canvas
+        if(ctx.interactive)
+            world_view = false;
 
-    for(int y = min_y + 1; y < max_y; y++){
-        // Get the intersections with the scanline
-        std::vector<int> v;
-        for(int i = 0; i < (int) verts.size(); i++) {
-            int k = (i + 1) % verts.size();
-            Point p1 = verts[i];
-            Point p2 = verts[k];
+        if(!culling)
+            clear(pixels);
+    }
 
-            if( ((y >= p1.y && y <= p2.y) || (y <= p1.y && y >= p2.y)) && (p1.y != p2.y) ) {
-                double m = (double) (p2.y - p1.y) / (double) (p2.x - p1.x);
-                double c = p2.y - (double) m * (double) p2.x;
-                int x = p1.x == p2.x ? p1.x : round((y - c) / m);
+    // Long fills are drawn in slices when the canvas is being shown, otherwise in one go
+    const Uint64 deadline = ctx.interactive ? slice_end : UINT64_MAX;
+
+    // Scratch copy of the polygon that the command is free to change
+    Polygon verts(cmd.verts.begin(), cmd.verts.end(), &ctx.arena);
+
+    switch(cmd.type) {
+        case CMD_QUIT:
+            // Tell the main thread we're done
+            running = false;
+            return false;
+        case CMD_CLIP: {
+            Polygon first_poly = translate_polygon(verts, cmd.a);
+            Polygon second_poly = translate_polygon(verts, Point { cmd.b.y, cmd.b.y });
+
+            if(cmd.option == 1) {
+                // Sutherlang-Hodgman
+                sutherland_hodgman(first_poly, clipper);
+                sutherland_hodgman(second_poly, clipper);
+
+                if(culling) {
+                    // The second polygon is in front so it's drawn first
+                    draw_polygon(pixels, second_poly, 0x00FF0000, &ctx.coverage_mask);
+                    draw_polygon(pixels, first_poly, 0xFF000000, &ctx.coverage_mask);
+                } else {
+                    draw_polygon(pixels, first_poly, 0xFF000000);
+                    draw_polygon(pixels, second_poly, 0x00FF0000);
+                }
+            } else if(cmd.option == 2) {
+                // Liang-Barsky
+
+                // TODO
+            }
 
-                v.push_back(x);
+            if(culling) {
+                // The background is whatever is left, which also resets the mask for next time
+                for(int y = 0; y < SCREEN_HEIGHT; y++) {
+                    fill_span(pixels, y, 0, SCREEN_WIDTH - 1, 0x00000000, &ctx.coverage_mask);
+                    std::fill(ctx.coverage_mask.bits[y], ctx.coverage_mask.bits[y] + MASK_WORDS, 0);
+                }
             }
+            break;
         }
+        case CMD_FLOODFILL: {
+            sutherland_hodgman(verts, clipper); // Clip the polygon
+            draw_polygon(pixels, verts, 0xFF000000);
+
+            // Draw a slice at a time until it's done or a newer command replaces it
+            FloodFill fill { 0, Scratch<Pixel>(&ctx.arena) };
+            floodfill_start(fill, fixed_round(cmd.a.x), fixed_round(cmd.a.y), 0xFF000000);
+            while(!floodfill_step(pixels, fill, deadline) && next_slice());
+            break;
+        }
+        case CMD_SCANLINE: {
+            sutherland_hodgman(verts, clipper);
 
-        // Sort the intersections by X
-        std::sort(v.begin(), v.end());
-        // Remove duplicates
-        v.erase(std::unique(v.begin(), v.end()), v.end());
-
-        // Connect pairs of intersections by a line
-        for(int i = 0; i < (int) v.size() - 1; i += 2) {
-            draw_line(pixels, Point { v[i], y }, Point { v[i + 1], y }, color);
+            Scanline scan { NULL, 0, 0, 0, Scratch<int>(&ctx.arena) };
+            scanline_start(scan, verts, 0x00FF0000);
+            while(!scanline_step(pixels, scan, deadline) && next_slice());
+            break;
         }
-    }
+        case CMD_TRIANGLES: {
+            sutherland_hodgman(verts, clipper);
+            Scratch<Triangle> tris = triangulate(verts);
+            draw_triangles(pixels, tris, 0x0000FF00, ctx.fill_pool);
+            break;
+        }
+        case CMD_FILL_RULE:
+            // The polygon isn't clipped first, the rasterizer clips each edge itself which keeps the
+            // winding of self-intersecting polygons intact.
+            draw_coverage(pixels, verts, 0xFFFFFF00, cmd.option == 1 ? EVEN_ODD : NON_ZERO, cmd.antialias);
+            break;
+        case CMD_CULLING:
+            ctx.occlusion_culling = cmd.option;
+            break;
+        case CMD_WORLD:
+            if(!ctx.interactive) {
+                // There's no view to pan, draw the shape where the world view starts
+                draw_coverage(pixels, verts, cmd.color, NON_ZERO, true);
+                break;
+            }
 
-    dirty = true;
+            // Shapes stay in the world after the command so they can't live in an arena
+            world.push_back(make_shape(cmd.verts, cmd.color));
 
-    SDL_UnlockMutex(mutex);
-}
+            // The main thread redraws the world on the next frame
+            world_view = true;
+            world_changed = true;
+            break;
+    }
 
+    return true;
+}
 
-// Helper function to make sure we're only writing to pixels on the screen
+// Let the main thread show what has been drawn so far and start a new slice. Returns false if
+// a newer command that clears the canvas has been queued and the current one should stop.
 // MUST BE USED WHEN THE MUTEX IS LOCKED
-void plot_point(uint32_t pixels[][SCREEN_WIDTH], int x, int y, uint32_t color) {
-    if((y >= 0 && y < SCREEN_HEIGHT) && (x >= 0 && x < SCREEN_WIDTH))
-        pixels[y][x] = color;
+bool next_slice() {
+    dirty = true;
+    SDL_UnlockMutex(mutex);
+
+    // The main thread only tries the mutex once a frame, give it a frame to take the canvas
+    bool locked = false;
+    Uint32 start = SDL_GetTicks();
+    while(!locked && SDL_GetTicks() - start < FRAME_BUDGET) {
+        SDL_Delay(1);
+
+        if(SDL_TryLockMutex(mutex) == 0) {
+            locked = !dirty;
+
+            if(!locked)
+                SDL_UnlockMutex(mutex);
+        }
+    }
+
+    if(!locked)
+        SDL_LockMutex(mutex);
+
+    slice_end = SDL_GetPerformanceCounter() + SDL_GetPerformanceFrequency() * FRAME_BUDGET / 1000;
+
+    // Commands that don't clear the canvas would leave the fill half drawn, they wait for it
+    const int tail = SDL_AtomicGet(&queue.tail);
+    for(int i = batch_tail; i < tail; i++) {
+        if(clears_canvas(queue.commands[i % QUEUE_SIZE].type))
+            return false;
+    }
+
+    return true;
+}
+
+// Drains the command queue, running whatever has been queued since the last batch together
+int render(void* ptr) {
+    SDL_Surface* canvas = (SDL_Surface*) ptr;
+    uint32_t (*pixels)[SCREEN_WIDTH] = (uint32_t(*)[SCREEN_WIDTH]) canvas->pixels;
+
+    // This thread fills a band of each large triangle fill too
+    fill_pool_start(render_context.fill_pool, SDL_GetCPUCount() - 1);
+
+    bool rendering = true;
+    while(rendering) {
+        const int head = SDL_AtomicGet(&queue.head);
+        const int tail = SDL_AtomicGet(&queue.tail);
+
+        if(head == tail) {
+            SDL_Delay(1);
+            continue;
+        }
+
+        // Anything drawn before the last command that clears the canvas would never be seen
+        int last_clear = head;
+        for(int i = head; i < tail; i++) {
+            if(clears_canvas(queue.commands[i % QUEUE_SIZE].type))
+                last_clear = i;
+        }
+
+        SDL_LockMutex(mutex);
+
+        batch_tail = tail;
+        slice_end = SDL_GetPerformanceCounter() + SDL_GetPerformanceFrequency() * FRAME_BUDGET / 1000;
+
+        for(int i = head; i < tail && rendering; i++) {
+            const Command& cmd = queue.commands[i % QUEUE_SIZE];
+
+            if(i < last_clear && clears_canvas(cmd.type))
+                continue;
+
+            // Show the batch so far if it's taking longer than a frame
+            if(SDL_GetPerformanceCounter() > slice_end)
+                next_slice();
+
+            rendering = run_command(render_context, pixels, cmd);
+
+            // Nothing from the command is needed anymore
+            render_context.arena.reset();
+        }
+
+        // Tell the main thread we have changed the texture
+        dirty = true;
+
+        SDL_UnlockMutex(mutex);
+
+        // Give the slots back to the input thread
+        SDL_AtomicSet(&queue.head, tail);
+    }
+
+    fill_pool_stop(render_context.fill_pool);
+
+    return 0;
+}
+
+//
+// Job mode
+//
+// Draws many scene scripts at once. Each worker thread takes the next script, draws it on its
+// own canvas with its own scratch memory and saves the canvas as a BMP, so workers never wait
+// on each other apart from taking a job index.
+
+int run_jobs(const char* scenes, const char* output, int workers) {
+    JobList list;
+    if(!list_jobs(list, scenes, output))
+        return 1;
+
+    // Make the output directory if it isn't there, otherwise every job would fail to save
+    if(mkdir(output, 0777) != 0 && errno != EEXIST) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "could not create output directory %s: %s\n", output, strerror(errno));
+        return 1;
+    }
+    if(DIR* dir = opendir(output)) {
+        closedir(dir);
+    } else {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "%s is not a directory\n", output);
+        return 1;
+    }
+
+    SDL_AtomicSet(&list.next, 0);
+    workers = std::max(1, std::min(workers, (int) list.jobs.size()));
+
+    const Uint64 start = SDL_GetPerformanceCounter();
+
+    std::vector<SDL_Thread*> threads;
+    for(int i = 0; i < workers; i++) {
+        SDL_Thread* thread = SDL_CreateThread(job_worker, "JobThread", &list);
+        if(thread == NULL) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "could not create job thread: %s\n", SDL_GetError());
+            break;
+        }
+        threads.push_back(thread);
+    }
+
+    // Without any threads the jobs are drawn here
+    if(threads.empty()) {
+        workers = 1;
+        job_worker(&list);
+    }
+
+    for(auto thread : threads) {
+        SDL_WaitThread(thread, NULL);
+    }
+
+    const double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    // Summary of every job
+    int failed = 0;
+    printf("%-40s %10s  %s\n", "scene", "ms", "image");
+    for(auto& job : list.jobs) {
+        printf("%-40s %10.2f  %s\n", job.script.c_str(), job.ms, job.ok ? job.image.c_str() : "FAILED");
+
+        if(!job.ok)
+            failed++;
+    }
+
+    printf("%d scenes in %.3f s on %d workers, %.1f scenes/s", (int) list.jobs.size(), seconds, workers, list.jobs.size() / seconds);
+    if(failed > 0)
+        printf(", %d failed", failed);
+    printf("\n");
+
+    return failed == 0 ? 0 : 1;
+}
+
+// Find the scene scripts, either every .txt file in a directory or every line of a manifest.
+// Each image is named after its script's path as listed, with '/' replaced by '_', so scripts
+// with the same name in different directories get different images.
+bool list_jobs(JobList& list, const std::string& scenes, const std::string& output) {
+    std::vector<std::string> scripts;
+    std::vector<std::string> names;
+
+    if(DIR* dir = opendir(scenes.c_str())) {
+        while(dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if(name.size() > 4 && name.compare(name.size() - 4, 4, ".txt") == 0)
+                names.push_back(name);
+        }
+        closedir(dir);
+
+        std::sort(names.begin(), names.end());
+        for(auto& name : names) {
+            scripts.push_back(scenes + "/" + name);
+        }
+    } else {
+        FILE* manifest = fopen(scenes.c_str(), "r");
+        if(manifest == NULL) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "could not read scenes from %s\n", scenes.c_str());
+            return false;
+        }
+
+        // Paths in the manifest are relative to the manifest
+        const size_t slash = scenes.find_last_of('/');
+        const std::string base = slash == std::string::npos ? "" : scenes.substr(0, slash + 1);
+
+        char line[1024];
+        while(fgets(line, sizeof(line), manifest) != NULL) {
+            std::string path = line;
+            path.erase(path.find_last_not_of(" \t\r\n") + 1);
+
+            // Skip blank lines and comments
+            if(path.empty() || path[0] == '#')
+                continue;
+
+            scripts.push_back(path[0] == '/' ? path : base + path);
+            names.push_back(path);
+        }
+        fclose(manifest);
+    }
+
+    std::vector<std::string> images;
+    for(size_t i = 0; i < scripts.size(); i++) {
+        std::string name = names[i];
+        name = name.substr(0, name.find_last_of('.'));
+        name.erase(0, name.find_first_not_of('/'));
+        std::replace(name.begin(), name.end(), '/', '_');
+
+        list.jobs.push_back(Job { scripts[i], output + "/" + name + ".bmp", 0.0, false });
+        images.push_back(list.jobs.back().image);
+    }
+
+    // Two scripts saving to the same image would overwrite each other, such as a.txt listed twice
+    std::sort(images.begin(), images.end());
+    auto duplicate = std::adjacent_find(images.begin(), images.end());
+    if(duplicate != images.end()) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "more than one scene would be saved to %s\n", duplicate->c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// Draw jobs until there are none left
+int job_worker(void* ptr) {
+    JobList* list = (JobList*) ptr;
+
+    // No fill pool, the other workers already keep every CPU busy
+    RenderContext ctx(false);
+    Command cmd;
+
+    SDL_Surface* canvas = SDL_CreateRGBSurfaceWithFormat(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, SDL_PIXELFORMAT_RGBA8888);
+    if(canvas == NULL) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "could not create surface: %s\n", SDL_GetError());
+        return 1;
+    }
+    uint32_t (*pixels)[SCREEN_WIDTH] = (uint32_t(*)[SCREEN_WIDTH]) canvas->pixels;
+
+    while(true) {
+        const int i = SDL_AtomicAdd(&list->next, 1);
+        if(i >= (int) list->jobs.size())
+            break;
+
+        Job& job = list->jobs[i];
+        const Uint64 start = SDL_GetPerformanceCounter();
+
+        FILE* in = fopen(job.script.c_str(), "r");
+        job.ok = in != NULL && draw_scene(ctx, pixels, cmd, in);
+        if(in != NULL)
+            fclose(in);
+
+        job.ok = job.ok && SDL_SaveBMP(canvas, job.image.c_str()) == 0;
+        job.ms = (double) (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+    }
+
+    SDL_FreeSurface(canvas);
+    return 0;
+}
+
+// Draw a scene script onto the canvas. A script is what would be typed into the menu, without
+// the prompts, and ends with option 1 or the end of the file. Like the menu, a script that ends
+// partway through an option keeps what has been drawn and skips the rest of that option.
+// Returns false if the script can't be read.
+bool draw_scene(RenderContext& ctx, uint32_t pixels[][SCREEN_WIDTH], Command& cmd, FILE* in) {
+    ctx.occlusion_culling = false;
+    clear(pixels);
+
+    int option;
+    while(fscanf(in, "%d", &option) == 1) {
+        reset_command(cmd);
+
+        switch(option) {
+            case 1:
+                return true;
+            case 2:
+                cmd.type = CMD_CLIP;
+                if(!scene_polygon(in, cmd.verts) || !scene_point(in, cmd.a) || !scene_point(in, cmd.b))
+                    return feof(in);
+                if(fscanf(in, "%d", &cmd.option) != 1)
+                    return feof(in);
+                if(cmd.option != 1 && cmd.option != 2)
+                    return false;
+                break;
+            case 3: {
+                cmd.type = CMD_FLOODFILL;
+                if(!scene_polygon(in, cmd.verts) || !scene_point(in, cmd.a))
+                    return feof(in);
+
+                run_command(ctx, pixels, cmd);
+                ctx.arena.reset();
+
+                // Scan-line fill waits for a 'y'
+                if(!scene_confirm(in))
+                    return true;
+                cmd.type = CMD_SCANLINE;
+                run_command(ctx, pixels, cmd);
+                ctx.arena.reset();
+
+                // Triangle fill is a y/n choice like in the menu, then it's drawn below like
+                // every other command
+                char answer;
+                if(fscanf(in, " %c", &answer) != 1)
+                    return true;
+                if(answer != 'y')
+                    continue;
+                cmd.type = CMD_TRIANGLES;
+                break;
+            }
+            case 4: {
+                cmd.type = CMD_FILL_RULE;
+                char aa;
+                if(!scene_polygon(in, cmd.verts) || fscanf(in, "%d %c", &cmd.option, &aa) != 2)
+                    return feof(in);
+                if(cmd.option != 1 && cmd.option != 2)
+                    return false;
+                cmd.antialias = aa == 'y';
+                break;
+            }
+            case 5:
+                cmd.type = CMD_WORLD;
+                if(!scene_polygon(in, cmd.verts) || fscanf(in, "%x", &cmd.color) != 1)
+                    return feof(in);
+                break;
+            case 6:
+                cmd.type = CMD_CULLING;
+                cmd.option = !ctx.occlusion_culling;
+                break;
+            default:
+                return false;
+        }
+
+        run_command(ctx, pixels, cmd);
+        ctx.arena.reset();
+    }
+
+    return feof(in);
+}
+
+// Read a polygon the way menu_polygon does
+bool scene_polygon(FILE* in, Polygon& points) {
+    int n;
+    if(fscanf(in, "%d", &n) != 1 || n <= 2)
+        return false;
+
+    for(int i = 0; i < n; i++) {
+        Point p;
+        if(!scene_point(in, p))
+            return false;
+        points.push_back(p);
+    }
+
+    return true;
+}
+
+bool scene_point(FILE* in, Point& p) {
+    int x, y;
+    if(fscanf(in, "%d %d", &x, &y) != 2)
+        return false;
+
+    p = input_point(x, y);
+    return true;
+}
+
+// Skip to the next 'y', the menu waits for one before some of the fills
+bool scene_confirm(FILE* in) {
+    char c;
+    while(fscanf(in, " %c", &c) == 1) {
+        if(c == 'y')
+            return true;
+    }
+
+    return false;
+}
+
+// 
+// Sutherland-Hodgman Algorithm
+// https://www.geeksforgeeks.org/polygon-clipping-sutherland-hodgman-algorithm-please-change-bmp-images-jpeg-png/
+
+// Returns the point where the edge from pi to pk crosses the line, given how far each end is
+// from the line (the cross products sh_clip works out). Only the edge is used for the answer
+// so it's exact to within rounding and can't overflow like solving for the two lines can.
+Point intersect(Point pi, Point pk, int64_t i_pos, int64_t k_pos) {
+    return Point {
+        fixed_lerp(pi.x, pk.x, i_pos, i_pos - k_pos),
+        fixed_lerp(pi.y, pk.y, i_pos, i_pos - k_pos)
+    };
+}
+
+void sh_clip(Polygon& verts, Point p0, Point p1) {
+    // Each edge adds at most two vertices
+    Polygon new_verts(verts.get_allocator());
+    new_verts.reserve(verts.size() * 2);
+
+    for(int i = 0; i < (int) verts.size(); i++) {
+        int k = (i + 1) % verts.size();
+        Point pi = verts[i];
+        Point pk = verts[k];
+
+        int64_t i_pos = ((int64_t) p1.x - p0.x) * ((int64_t) pi.y - p0.y) - ((int64_t) p1.y - p0.y) * ((int64_t) pi.x - p0.x);
+        int64_t k_pos = ((int64_t) p1.x - p0.x) * ((int64_t) pk.y - p0.y) - ((int64_t) p1.y - p0.y) * ((int64_t) pk.x - p0.x);
+
+        if(i_pos < 0 && k_pos < 0) {
+
+            // Case 1: Both points are inside
+            new_verts.push_back(pk);
+
+        } else if(i_pos >= 0 && k_pos < 0) {
+            
+            // Case 2: First point is outside
+            new_verts.push_back(intersect(pi, pk, i_pos, k_pos));
+
+            new_verts.push_back(pk);
+            
+        } else if(i_pos < 0 && k_pos >= 0) {
+            // Case 3: Second point is outside
+            
+            new_verts.push_back(intersect(pi, pk, i_pos, k_pos));
+
+        } else {
+            // Case 4: Both are outside, do nothing
+        }
+    }
+
+    verts.swap(new_verts);
+}
+
+void sutherland_hodgman(Polygon& verts, const std::vector<Point>& clipper) {
+    for(int i = 0; i < (int) clipper.size(); i++) {
+        int k = (i + 1) % clipper.size();
+        sh_clip(verts, clipper[i], clipper[k]);
+    }
+}
+
+//
+// Liang-Barsky Algorithm
+//
+void liangBarsky(float xmin, float ymin, float xmax, float ymax, Point pi, Point pk) {
+}
+
+//
+// Flood Fill
+//
+// Done with an explicit stack so it can stop when its time is up and carry on later, and so
+// large polygons don't run out of call stack.
+void floodfill_start(FloodFill& fill, int x, int y, uint32_t color) {
+    fill.color = color;
+    fill.stack.clear();
+    fill.stack.push_back(Pixel { x, y });
+}
+
+// Returns true once the fill is finished
+// MUST BE USED WHEN THE MUTEX IS LOCKED
+bool floodfill_step(uint32_t pixels[][SCREEN_WIDTH], FloodFill& fill, Uint64 deadline) {
+    int count = 0;
+
+    while(!fill.stack.empty()) {
+        // Reading the clock is slow compared to filling a pixel so only check it now and then
+        if(++count % 1024 == 0 && SDL_GetPerformanceCounter() > deadline)
+            return false;
+
+        Pixel p = fill.stack.back();
+        fill.stack.pop_back();
+
+        // Check to make sure we aren't accidentally writing to memory outside of the screen if
+        // for some reason we break free from the polygon
+        if((p.x <= 0 || p.x >= SCREEN_WIDTH) || (p.y <= 0 || p.y >= SCREEN_HEIGHT))
+            continue;
+
+        if(pixels[p.y][p.x] == fill.color)
+            continue;
+
+        pixels[p.y][p.x] = fill.color;
+
+        fill.stack.push_back(Pixel { p.x + 1, p.y });
+        fill.stack.push_back(Pixel { p.x - 1, p.y });
+        fill.stack.push_back(Pixel { p.x, p.y + 1 });
+        fill.stack.push_back(Pixel { p.x, p.y - 1 });
+    }
+
+    return true;
+}
+
+// MUST BE USED WHEN THE MUTEX IS LOCKED
+void draw_floodfill(uint32_t pixels[][SCREEN_WIDTH], int x, int y, uint32_t color) {
+    Arena arena;
+    FloodFill fill { 0, Scratch<Pixel>(&arena) };
+    floodfill_start(fill, x, y, color);
+    floodfill_step(pixels, fill, UINT64_MAX);
+}
+
+//
+// Scan-line algorithm
+//
+// Like flood fill this can be drawn a few rows at a time.
+void scanline_start(Scanline& scan, const Polygon& verts, uint32_t color) {
+    scan.verts = &verts;
+    scan.color = color;
+    scan.y = 0;
+    scan.max_y = 0;
+
+    if(verts.empty())
+        return;
+
+    fixed min_y = verts[0].y;
+    fixed max_y = verts[0].y;
+
+    for(auto& vert : verts) {
+        if(vert.y < min_y) {
+            min_y = vert.y;
+        }
+
+        if(vert.y > max_y) {
+            max_y = vert.y;
+        }
+    }
+
+    scan.y = fixed_round(min_y) + 1;
+    scan.max_y = fixed_round(max_y);
+
+    // Every edge crosses the scanline at most once
+    scan.v.clear();
+    scan.v.reserve(verts.size());
+}
+
+// Returns true once every row has been drawn
+// MUST BE USED WHEN THE MUTEX IS LOCKED
+bool scanline_step(uint32_t pixels[][SCREEN_WIDTH], Scanline& scan, Uint64 deadline) {
+    const Polygon& verts = *scan.verts;
+    Scratch<int>& v = scan.v;
+
+    for(; scan.y < scan.max_y; scan.y++) {
+        if(SDL_GetPerformanceCounter() > deadline)
+            return false;
+
+        const int y = scan.y;
+        const fixed fy = to_fixed(y);
+
+        // Get the intersections with the scanline
+        v.clear();
+        for(int i = 0; i < (int) verts.size(); i++) {
+            int k = (i + 1) % verts.size();
+            Point p1 = verts[i];
+            Point p2 = verts[k];
+
+            if( ((fy >= p1.y && fy <= p2.y) || (fy <= p1.y && fy >= p2.y)) && (p1.y != p2.y) ) {
+                int x = fixed_round(fixed_lerp(p1.x, p2.x, (int64_t) fy - p1.y, (int64_t) p2.y - p1.y));
+
+                v.push_back(x);
+            }
+        }
+
+        // Sort the intersections by X
+        std::sort(v.begin(), v.end());
+        // Remove duplicates
+        v.erase(std::unique(v.begin(), v.end()), v.end());
+
+        // Connect pairs of intersections by a line
+        for(int i = 0; i < (int) v.size() - 1; i += 2) {
+            draw_line(pixels, Point { to_fixed(v[i]), fy }, Point { to_fixed(v[i + 1]), fy }, scan.color);
+        }
+    }
+
+    return true;
+}
+
+// MUST BE USED WHEN THE MUTEX IS LOCKED
+void draw_scanline(uint32_t pixels[][SCREEN_WIDTH], const Polygon& verts, uint32_t color) {
+    Scanline scan { NULL, 0, 0, 0, Scratch<int>(verts.get_allocator()) };
+    scanline_start(scan, verts, color);
+    scanline_step(pixels, scan, UINT64_MAX);
+}
+
+//
+// Triangle fill
+//
+
+// Twice the signed area of the triangle a, b, c. Positive when the points turn clockwise on
+// screen (y grows downwards), which is the order the user is asked to enter points in.
+int64_t orient(Point a, Point b, Point c) {
+    return ((int64_t) b.x - a.x) * ((int64_t) c.y - a.y) - ((int64_t) b.y - a.y) * ((int64_t) c.x - a.x);
+}
+
+// Ear clipping triangulation
+// https://www.geometrictools.com/Documentation/TriangulationByEarClipping.pdf
+Scratch<Triangle> triangulate(const Polygon& verts) {
+    Scratch<Triangle> tris(verts.get_allocator());
+    Scratch<int> idx(verts.get_allocator());
+
+    if(verts.size() < 3) {
+        return tris;
+    }
+
+    // Work out the winding of the polygon so we know which way a convex corner turns
+    int64_t area = 0;
+    for(int i = 0; i < (int) verts.size(); i++) {
+        int k = (i + 1) % verts.size();
+        area += (int64_t) verts[i].x * verts[k].y - (int64_t) verts[k].x * verts[i].y;
+    }
+    const int winding = area < 0 ? -1 : 1;
+
+    tris.reserve(verts.size());
+    idx.reserve(verts.size());
+    for(int i = 0; i < (int) verts.size(); i++) {
+        idx.push_back(i);
+    }
+
+    // Each pass removes one vertex, if we go all the way around without finding an ear the
+    // polygon is self-intersecting and we keep the triangles we have so far.
+    int misses = 0;
+    int i = 0;
+    while(idx.size() > 3 && misses < (int) idx.size()) {
+        int n = idx.size();
+        Point a = verts[idx[(i + n - 1) % n]];
+        Point b = verts[idx[i % n]];
+        Point c = verts[idx[(i + 1) % n]];
+
+        int64_t turn = orient(a, b, c) * winding;
+
+        if(turn == 0) {
+            // Collinear or repeated vertex (sh_clip can produce these), drop it without a triangle
+            idx.erase(idx.begin() + i % n);
+            misses = 0;
+            continue;
+        }
+
+        bool ear = turn > 0;
+
+        // An ear must not contain any of the other vertices
+        for(int j = 0; ear && j < n; j++) {
+            Point p = verts[idx[j]];
+            if(j == (i + n - 1) % n || j == i % n || j == (i + 1) % n)
+                continue;
+
+            if(orient(a, b, p) * winding >= 0 && orient(b, c, p) * winding >= 0 && orient(c, a, p) * winding >= 0)
+                ear = false;
+        }
+
+        if(ear) {
+            tris.push_back(Triangle { a, b, c });
+            idx.erase(idx.begin() + i % n);
+            misses = 0;
+        } else {
+            i = (i + 1) % n;
+            misses++;
+        }
+    }
+
+    if(idx.size() == 3) {
+        Triangle tri { verts[idx[0]], verts[idx[1]], verts[idx[2]] };
+        if(orient(tri.a, tri.b, tri.c) != 0)
+            tris.push_back(tri);
+    }
+
+    return tris;
+}
+
+// One edge of a triangle as an edge function e(x, y) = a * x + b * y + c which is >= 0 for
+// pixels on the inside. Stepping one pixel in x adds a, stepping one pixel in y adds b. The
+// vertices are fixed point so the products need 64 bits.
+struct Edge {
+    int64_t a;
+    int64_t b;
+    int64_t c;
+
+    int64_t at(int x, int y) const {
+        return a * x + b * y + c;
+    }
+};
+
+Edge make_edge(Point p0, Point p1) {
+    Edge e {
+        ((int64_t) p0.y - p1.y) * FIXED_ONE,
+        ((int64_t) p1.x - p0.x) * FIXED_ONE,
+        (int64_t) p0.x * p1.y - (int64_t) p0.y * p1.x
+    };
+
+    // Top-left fill rule, pixels exactly on a shared edge belong to only one of the two
+    // triangles. Bias the other edges by one so the >= 0 test becomes > 0.
+    bool top = e.a == 0 && e.b > 0;
+    bool left = e.a > 0;
+    if(!top && !left)
+        e.c -= 1;
+
+    return e;
+}
+
+// Half-space triangle rasterizer
+// https://fgiesen.wordpress.com/2013/02/10/optimizing-the-basic-rasterizer/
+// Rows outside of [band_y0, band_y1) are not touched so several threads can share a canvas.
+// MUST BE USED WHEN THE MUTEX IS LOCKED
+void draw_triangle(uint32_t pixels[][SCREEN_WIDTH], Triangle tri, uint32_t color, int band_y0, int band_y1) {
+    // Make the vertices clockwise so the inside of every edge is positive
+    if(orient(tri.a, tri.b, tri.c) < 0)
+        std::swap(tri.b, tri.c);
+
+    const Edge e0 = make_edge(tri.b, tri.c);
+    const Edge e1 = make_edge(tri.c, tri.a);
+    const Edge e2 = make_edge(tri.a, tri.b);
+    const Edge* edges[3] = { &e0, &e1, &e2 };
+
+    // Bounding box in pixels, clipped to the screen and the band, then snapped to whole blocks
+    int min_x = std::max(std::min({ tri.a.x, tri.b.x, tri.c.x }) >> FIXED_SHIFT, 0);
+    int max_x = std::min(std::max({ tri.a.x, tri.b.x, tri.c.x }) >> FIXED_SHIFT, SCREEN_WIDTH - 1);
+    int min_y = std::max(std::min({ tri.a.y, tri.b.y, tri.c.y }) >> FIXED_SHIFT, band_y0);
+    int max_y = std::min(std::max({ tri.a.y, tri.b.y, tri.c.y }) >> FIXED_SHIFT, band_y1 - 1);
+
+    if(min_x > max_x || min_y > max_y)
+        return;
+
+    min_x &= ~(BLOCK_SIZE - 1);
+    min_y &= ~(BLOCK_SIZE - 1);
+
+    for(int by = min_y; by <= max_y; by += BLOCK_SIZE) {
+        for(int bx = min_x; bx <= max_x; bx += BLOCK_SIZE) {
+            const int x0 = bx;
+            const int x1 = bx + BLOCK_SIZE - 1;
+            const int y0 = by;
+            const int y1 = by + BLOCK_SIZE - 1;
+
+            // An edge function is linear so its extremes over the block are at the corners
+            int inside = 0;
+            int outside = 0;
+            bool crosses[3];
+            for(int k = 0; k < 3; k++) {
+                int c00 = edges[k]->at(x0, y0) >= 0;
+                int c10 = edges[k]->at(x1, y0) >= 0;
+                int c01 = edges[k]->at(x0, y1) >= 0;
+                int c11 = edges[k]->at(x1, y1) >= 0;
+
+                int n = c00 + c10 + c01 + c11;
+                if(n == 0)
+                    outside++;
+                if(n == 4)
+                    inside++;
+                crosses[k] = n > 0 && n < 4;
+            }
+
+            // Trivial reject, the whole block is outside of one edge
+            if(outside > 0)
+                continue;
+
+            const int row_start = std::max(y0, band_y0);
+            const int row_end = std::min(y1, band_y1 - 1);
+
+            // Trivial accept, the whole block is inside of every edge
+            if(inside == 3) {
+                for(int y = row_start; y <= row_end; y++) {
+                    uint32_t* row = &pixels[y][x0];
+                    for(int i = 0; i < BLOCK_SIZE; i++) {
+                        row[i] = color;
+                    }
+                }
+                continue;
+            }
+
+            // Partially covered, walk the edge functions incrementally. Edges the whole block is
+            // inside of are left out. An edge that crosses the block is within a block's width of
+            // zero everywhere in it, and triangles are clipped to the screen, so it fits in an int.
+            int a[3];
+            int b[3];
+            int w_row[3];
+            for(int k = 0; k < 3; k++) {
+                a[k] = crosses[k] ? (int) edges[k]->a : 0;
+                b[k] = crosses[k] ? (int) edges[k]->b : 0;
+                w_row[k] = crosses[k] ? (int) edges[k]->at(x0, row_start) : 0;
+            }
+
+#ifdef __SSE2__
+            // A block row is two vectors of 4 pixels. Or-ing the edge functions and shifting
+            // the sign across each lane gives a mask of the pixels outside of any edge.
+            const __m128i colors = _mm_set1_epi32((int) color);
+            __m128i w_lo[3];
+            __m128i w_hi[3];
+            __m128i step[3];
+            for(int k = 0; k < 3; k++) {
+                w_lo[k] = _mm_setr_epi32(w_row[k], w_row[k] + a[k], w_row[k] + 2 * a[k], w_row[k] + 3 * a[k]);
+                w_hi[k] = _mm_add_epi32(w_lo[k], _mm_set1_epi32(4 * a[k]));
+                step[k] = _mm_set1_epi32(b[k]);
+            }
+
+            for(int y = row_start; y <= row_end; y++) {
+                __m128i* row = (__m128i*) &pixels[y][x0];
+
+                const __m128i out_lo = _mm_srai_epi32(_mm_or_si128(_mm_or_si128(w_lo[0], w_lo[1]), w_lo[2]), 31);
+                const __m128i out_hi = _mm_srai_epi32(_mm_or_si128(_mm_or_si128(w_hi[0], w_hi[1]), w_hi[2]), 31);
+
+                _mm_storeu_si128(row, _mm_or_si128(_mm_and_si128(out_lo, _mm_loadu_si128(row)), _mm_andnot_si128(out_lo, colors)));
+                _mm_storeu_si128(row + 1, _mm_or_si128(_mm_and_si128(out_hi, _mm_loadu_si128(row + 1)), _mm_andnot_si128(out_hi, colors)));
+
+                for(int k = 0; k < 3; k++) {
+                    w_lo[k] = _mm_add_epi32(w_lo[k], step[k]);
+                    w_hi[k] = _mm_add_epi32(w_hi[k], step[k]);
+                }
+            }
+#else
+            // Without SSE2 the row is written without branches so the compiler can vectorize it
+            for(int y = row_start; y <= row_end; y++) {
+                uint32_t* row = &pixels[y][x0];
+
+                for(int i = 0; i < BLOCK_SIZE; i++) {
+                    int w0 = w_row[0] + a[0] * i;
+                    int w1 = w_row[1] + a[1] * i;
+                    int w2 = w_row[2] + a[2] * i;
+
+                    // The sign bit is set when the pixel is outside of any edge
+                    row[i] = (w0 | w1 | w2) >= 0 ? color : row[i];
+                }
+
+                w_row[0] += b[0];
+                w_row[1] += b[1];
+                w_row[2] += b[2];
+            }
+#endif
+        }
+    }
+}
+
+int draw_triangle_band(void* ptr) {
+    TriangleBand* band = (TriangleBand*) ptr;
+
+    for(auto& tri : *band->tris) {
+        draw_triangle(band->pixels, tri, band->color, band->y0, band->y1);
+    }
+
+    return 0;
+}
+
+// Start up to `threads` fill workers. If a thread can't be started the pool makes do with the
+// ones that did, with none every fill is drawn on the render thread.
+void fill_pool_start(FillPool& pool, int threads) {
+    pool.quit = false;
+    pool.done = SDL_CreateSemaphore(0);
+    if(pool.done == NULL)
+        return;
+
+    threads = std::min(threads, FILL_THREADS_MAX - 1);
+    for(int i = 0; i < threads; i++) {
+        FillWorker& worker = pool.workers[i];
+        worker.pool = &pool;
+        worker.start = SDL_CreateSemaphore(0);
+        if(worker.start == NULL)
+            break;
+
+        worker.thread = SDL_CreateThread(fill_worker, "FillThread", &worker);
+        if(worker.thread == NULL) {
+            SDL_DestroySemaphore(worker.start);
+            break;
+        }
+
+        pool.count++;
+    }
+}
+
+// Wake every worker to tell it to exit, then wait for them
+void fill_pool_stop(FillPool& pool) {
+    pool.quit = true;
+    for(int i = 0; i < pool.count; i++) {
+        SDL_SemPost(pool.workers[i].start);
+    }
+
+    for(int i = 0; i < pool.count; i++) {
+        SDL_WaitThread(pool.workers[i].thread, NULL);
+        SDL_DestroySemaphore(pool.workers[i].start);
+    }
+
+    if(pool.done != NULL)
+        SDL_DestroySemaphore(pool.done);
+
+    pool.count = 0;
+    pool.done = NULL;
+}
+
+// The semaphores order the band and quit flag between the render thread and the worker
+int fill_worker(void* ptr) {
+    FillWorker* worker = (FillWorker*) ptr;
+
+    while(true) {
+        SDL_SemWait(worker->start);
+        if(worker->pool->quit)
+            break;
+
+        draw_triangle_band(&worker->band);
+        SDL_SemPost(worker->pool->done);
+    }
+
+    return 0;
+}
+
+// Fill a triangulated polygon. Large polygons are split into horizontal bands that are filled
+// by the pool's workers, small ones aren't worth waking them for.
+// MUST BE USED WHEN THE MUTEX IS LOCKED
+void draw_triangles(uint32_t pixels[][SCREEN_WIDTH], const Scratch<Triangle>& tris, uint32_t color, FillPool& pool) {
+    // Area in pixels, the orientation is in fixed point squared
+    int64_t area = 0;
+    for(auto& tri : tris) {
+        area += llabs(orient(tri.a, tri.b, tri.c)) / (2 * FIXED_ONE * FIXED_ONE);
+    }
+
+    if(area < 64 * 64 || pool.count == 0) {
+        for(auto& tri : tris) {
+            draw_triangle(pixels, tri, color, 0, SCREEN_HEIGHT);
+        }
+        return;
+    }
+
+    // Bands are a whole number of blocks tall so no block is shared between two threads. This
+    // thread fills the first band and the workers fill the rest.
+    int rows = (FILL_THREADS_MAX + pool.count) / (pool.count + 1) * BLOCK_SIZE;
+
+    int given = 0;
+    for(int y = rows; y < SCREEN_HEIGHT; y += rows) {
+        FillWorker& worker = pool.workers[given++];
+        worker.band = TriangleBand { pixels, &tris, color, y, std::min(y + rows, SCREEN_HEIGHT) };
+        SDL_SemPost(worker.start);
+    }
+
+    TriangleBand first { pixels, &tris, color, 0, std::min(rows, SCREEN_HEIGHT) };
+    draw_triangle_band(&first);
+
+    for(int i = 0; i < given; i++) {
+        SDL_SemWait(pool.done);
+    }
+}
+
+//
+// Coverage accumulation rasterizer
+// https://medium.com/@raphlinus/inside-the-fastest-font-renderer-in-the-world-75ae5270c445
+//
+// Every edge deposits the signed area it covers into the cells of each row it crosses, a
+// running sum along the row then gives the winding number (or coverage, when anti-aliasing)
+// of every pixel. The work per edge is fixed and each pixel is visited once, no matter how
+// many times the polygon crosses itself.
+struct Coverage {
+    int width;
+    int height;
+    // One extra cell on each row for edges that end on the right side of the last pixel
+    std::vector<float> cells;
+    // Range of cells touched on each row so only those are summed and cleared
+    std::vector<int> min_x;
+    std::vector<int> max_x;
+
+    Coverage(int w, int h) : width(w), height(h), cells((w + 2) * h, 0.0f), min_x(h, w + 1), max_x(h, -1) {}
+
+    void add_cell(int x, int y, float value) {
+        cells[y * (width + 2) + x] += value;
+        min_x[y] = std::min(min_x[y], x);
+        max_x[y] = std::max(max_x[y], x);
+    }
+
+    void add_line(float x0, float y0, float x1, float y1);
+    void add_edge(float x0, float y0, float x1, float y1);
+    void fill(uint32_t* pixels, int stride, uint32_t color, FillRule rule, bool antialias);
+};
+
+// Deposit a line that lies within 0 <= x <= width
+void Coverage::add_line(float x0, float y0, float x1, float y1) {
+    if(y0 == y1)
+        return;
+
+    // Edges going up subtract from the winding, edges going down add to it
+    float dir = 1.0f;
+    if(y0 > y1) {
+        std::swap(x0, x1);
+        std::swap(y0, y1);
+        dir = -1.0f;
+    }
+
+    const float dxdy = (x1 - x0) / (y1 - y0);
+    const int row_start = std::max((int) floorf(y0), 0);
+    const int row_end = std::min((int) ceilf(y1), height);
+
+    for(int y = row_start; y < row_end; y++) {
+        // The part of the line within this row
+        const float top = std::max((float) y, y0);
+        const float bottom = std::min((float) (y + 1), y1);
+        if(bottom <= top)
+            continue;
+
+        const float d = (bottom - top) * dir;
+        const float xa = x0 + (top - y0) * dxdy;
+        const float xb = x0 + (bottom - y0) * dxdy;
+        const float left = std::min(xa, xb);
+        const float right = std::max(xa, xb);
+
+        const int left_i = (int) floorf(left);
+        const int right_i = (int) ceilf(right);
+
+        if(right_i <= left_i + 1) {
+            // The line stays within one pixel, split it between this pixel and the next
+            const float mid = 0.5f * (xa + xb) - left_i;
+            add_cell(left_i, y, d * (1.0f - mid));
+            add_cell(left_i + 1, y, d * mid);
+        } else {
+            // The line crosses several pixels, each gets the area of the trapezoid under it
+            const float s = 1.0f / (right - left);
+            const float left_f = left - left_i;
+            const float a0 = 0.5f * s * (1.0f - left_f) * (1.0f - left_f);
+            const float right_f = right - right_i + 1.0f;
+            const float am = 0.5f * s * right_f * right_f;
+
+            add_cell(left_i, y, d * a0);
+
+            if(right_i == left_i + 2) {
+                add_cell(left_i + 1, y, d * (1.0f - a0 - am));
+            } else {
+                const float a1 = s * (1.5f - left_f);
+                add_cell(left_i + 1, y, d * (a1 - a0));
+
+                for(int x = left_i + 2; x < right_i - 1; x++) {
+                    add_cell(x, y, d * s);
+                }
+
+                const float a2 = a1 + (right_i - left_i - 3) * s;
+                add_cell(right_i - 1, y, d * (1.0f - a2 - am));
+            }
+
+            add_cell(right_i, y, d * am);
+        }
+    }
+}
+
+// Deposit any polygon edge. Parts of the edge to the left or right of the buffer are moved
+// onto its border, this keeps their effect on the winding of the row without drawing them.
+void Coverage::add_edge(float x0, float y0, float x1, float y1) {
+    float ts[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+    int n = 1;
+
+    // Split the edge where it crosses the left and right sides
+    for(float side : { 0.0f, (float) width }) {
+        if((x0 < side) != (x1 < side)) {
+            ts[n++] = (side - x0) / (x1 - x0);
+        }
+    }
+    if(n == 3 && ts[2] < ts[1])
+        std::swap(ts[1], ts[2]);
+    ts[n++] = 1.0f;
+
+    const float max_x = (float) width;
+    float px = x0;
+    float py = y0;
+    for(int i = 1; i < n; i++) {
+        float nx = i == n - 1 ? x1 : x0 + (x1 - x0) * ts[i];
+        float ny = i == n - 1 ? y1 : y0 + (y1 - y0) * ts[i];
+
+        add_line(
+            std::min(std::max(px, 0.0f), max_x), py,
+            std::min(std::max(nx, 0.0f), max_x), ny
+        );
+
+        px = nx;
+        py = ny;
+    }
+}
+
+// Sum each touched row, write the covered pixels and reset the cells for the next polygon
+void Coverage::fill(uint32_t* pixels, int stride, uint32_t color, FillRule rule, bool antialias) {
+    for(int y = 0; y < height; y++) {
+        if(max_x[y] < min_x[y])
+            continue;
+
+        float* row_cells = &cells[y * (width + 2)];
+        uint32_t* row = pixels + y * stride;
+        const int end = std::min(max_x[y], width - 1);
+
+        float acc = 0.0f;
+        for(int x = min_x[y]; x <= max_x[y]; x++) {
+            acc += row_cells[x];
+            row_cells[x] = 0.0f;
+
+            if(x > end)
+                continue;
+
+            float a = fabsf(acc);
+            if(rule == NON_ZERO) {
+                a = std::min(a, 1.0f);
+            } else {
+                a = fmodf(a, 2.0f);
+                if(a > 1.0f)
+                    a = 2.0f - a;
+            }
+
+            if(!antialias) {
+                if(a >= 0.5f)
+                    row[x] = color;
+                continue;
+            }
+
+            // Blend each channel of the pixel towards the color by the coverage
+            const uint32_t alpha = (uint32_t) (a * 256.0f + 0.5f);
+            if(alpha == 0)
+                continue;
+
+            uint32_t dst = row[x];
+            uint32_t out = 0;
+            for(int shift = 0; shift < 32; shift += 8) {
+                int d = (dst >> shift) & 0xFF;
+                int c = (color >> shift) & 0xFF;
+                out |= (uint32_t) (d + (((c - d) * (int) alpha) >> 8)) << shift;
+            }
+            row[x] = out;
+        }
+
+        min_x[y] = width + 1;
+        max_x[y] = -1;
+    }
+}
+
+// Fill a polygon with the given fill rule
+// MUST BE USED WHEN THE MUTEX IS LOCKED
+void draw_coverage(uint32_t pixels[][SCREEN_WIDTH], const Polygon& verts, uint32_t color, FillRule rule, bool antialias) {
+    // Job workers draw at the same time, each thread has its own
+    static thread_local Coverage coverage(SCREEN_WIDTH, SCREEN_HEIGHT);
+
+    // Vertices are the centres of pixels, the rasterizer measures from the corner
+    for(int i = 0; i < (int) verts.size(); i++) {
+        int k = (i + 1) % verts.size();
+        coverage.add_edge(
+            to_float(verts[i].x) + 0.5f, to_float(verts[i].y) + 0.5f,
+            to_float(verts[k].x) + 0.5f, to_float(verts[k].y) + 0.5f
+        );
+    }
+
+    coverage.fill(&pixels[0][0], SCREEN_WIDTH, color, rule, antialias);
+}
+
+//
+// World view
+//
+// The world is drawn in tiles that are kept in a cache, panning only has to draw the tiles that
+// come onto the screen. The least recently used tile is drawn over when the cache is full.
+std::list<Tile> tiles;
+std::unordered_map<uint64_t, std::list<Tile>::iterator> tile_index;
+
+// Indices of the shapes in each square of the world, in the order they were added. Only touched
+// by the main thread, shapes are added to it the next time the world is drawn.
+std::unordered_map<uint64_t, std::vector<int>> shape_buckets;
+std::vector<int> large_shapes;
+int shapes_indexed = 0;
+
+uint64_t tile_key(int zoom, int tx, int ty) {
+    return ((uint64_t) (uint8_t) zoom << 48) | ((uint64_t) (uint32_t) (tx & 0xFFFFFF) << 24) | (uint32_t) (ty & 0xFFFFFF);
+}
+
+float view_scale(int zoom) {
+    return powf(2.0f, zoom * 0.5f);
+}
+
+// Only touched by the main thread
+void pan_view(int dx, int dy) {
+    view.x += dx;
+    view.y += dy;
+    view_changed = true;
+}
+
+// Zoom about the centre of the screen
+void zoom_view(int steps) {
+    int zoom = std::min(std::max(view.zoom + steps, -16), 16);
+    if(zoom == view.zoom)
+        return;
+
+    float ratio = view_scale(zoom) / view_scale(view.zoom);
+    view.x = (int) roundf((view.x + SCREEN_WIDTH / 2) * ratio) - SCREEN_WIDTH / 2;
+    view.y = (int) roundf((view.y + SCREEN_HEIGHT / 2) * ratio) - SCREEN_HEIGHT / 2;
+    view.zoom = zoom;
+    view_changed = true;
+}
+
+Shape make_shape(const Polygon& verts, uint32_t color) {
+    Shape shape { std::vector<Point>(verts.begin(), verts.end()), color, verts[0], verts[0] };
+
+    for(auto& vert : verts) {
+        shape.min = Point { std::min(shape.min.x, vert.x), std::min(shape.min.y, vert.y) };
+        shape.max = Point { std::max(shape.max.x, vert.x), std::max(shape.max.y, vert.y) };
+    }
+
+    return shape;
+}
+
+// The square of the world a position in pixels is in. The view can pan past the edge of fixed
+// point, there are no shapes out there so any square past the edge will do.
+int world_bucket(float v) {
+    const float limit = (float) (1 << 30);
+    return (int) std::min(std::max(floorf(v * FIXED_ONE), -limit), limit) >> WORLD_BUCKET_SHIFT;
+}
+
+uint64_t bucket_key(int bx, int by) {
+    return ((uint64_t) (uint32_t) bx << 32) | (uint32_t) by;
+}
+
+// Add a new shape to the buckets it overlaps and drop the cached tiles it lands on
+void index_shape(int i) {
+    const Shape& shape = world[i];
+
+    const int bx0 = shape.min.x >> WORLD_BUCKET_SHIFT;
+    const int by0 = shape.min.y >> WORLD_BUCKET_SHIFT;
+    const int bx1 = shape.max.x >> WORLD_BUCKET_SHIFT;
+    const int by1 = shape.max.y >> WORLD_BUCKET_SHIFT;
+
+    if((int64_t) (bx1 - bx0 + 1) * (by1 - by0 + 1) > WORLD_BUCKET_LIMIT) {
+        large_shapes.push_back(i);
+    } else {
+        for(int by = by0; by <= by1; by++) {
+            for(int bx = bx0; bx <= bx1; bx++) {
+                shape_buckets[bucket_key(bx, by)].push_back(i);
+            }
+        }
+    }
+
+    for(auto it = tiles.begin(); it != tiles.end();) {
+        if(shape_on_tile(shape, it->zoom, it->tx, it->ty)) {
+            tile_index.erase(tile_key(it->zoom, it->tx, it->ty));
+            it = tiles.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Whether the shape's bounding box touches the tile, in the tile's pixels
+bool shape_on_tile(const Shape& shape, int zoom, int tx, int ty) {
+    const float scale = view_scale(zoom);
+    const float origin_x = (float) tx * TILE_SIZE;
+    const float origin_y = (float) ty * TILE_SIZE;
+
+    const float min_x = (to_float(shape.min.x) + 0.5f) * scale - origin_x;
+    const float min_y = (to_float(shape.min.y) + 0.5f) * scale - origin_y;
+    const float max_x = (to_float(shape.max.x) + 0.5f) * scale - origin_x;
+    const float max_y = (to_float(shape.max.y) + 0.5f) * scale - origin_y;
+
+    return !(max_x < 0 || max_y < 0 || min_x > TILE_SIZE || min_y > TILE_SIZE);
+}
+
+// Draw every shape that overlaps the tile
+void draw_tile(Tile& tile) {
+    static Coverage coverage(TILE_SIZE, TILE_SIZE);
+
+    const float scale = view_scale(tile.zoom);
+    const float origin_x = (float) tile.tx * TILE_SIZE;
+    const float origin_y = (float) tile.ty * TILE_SIZE;
+
+    std::fill(tile.pixels, tile.pixels + TILE_SIZE * TILE_SIZE, 0x00000000);
+
+    // The squares of the world under the tile, a pixel of slack on each side for rounding
+    const int bx0 = world_bucket((origin_x - 1) / scale - 0.5f);
+    const int by0 = world_bucket((origin_y - 1) / scale - 0.5f);
+    const int bx1 = world_bucket((origin_x + TILE_SIZE + 1) / scale - 0.5f);
+    const int by1 = world_bucket((origin_y + TILE_SIZE + 1) / scale - 0.5f);
+
+    // The shapes that could be on the tile, in the order they were added. Zoomed far out a tile
+    // covers too many squares and every shape is a candidate.
+    std::vector<int> candidates;
+    if((int64_t) (bx1 - bx0 + 1) * (by1 - by0 + 1) > WORLD_BUCKET_LIMIT) {
+        for(int i = 0; i < shapes_indexed; i++) {
+            candidates.push_back(i);
+        }
+    } else {
+        candidates = large_shapes;
+        for(int by = by0; by <= by1; by++) {
+            for(int bx = bx0; bx <= bx1; bx++) {
+                auto it = shape_buckets.find(bucket_key(bx, by));
+                if(it != shape_buckets.end())
+                    candidates.insert(candidates.end(), it->second.begin(), it->second.end());
+            }
+        }
+
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    }
+
+    for(int i : candidates) {
+        const Shape& shape = world[i];
+
+        // Skip shapes whose bounding box misses the tile
+        if(!shape_on_tile(shape, tile.zoom, tile.tx, tile.ty))
+            continue;
+
+        for(int i = 0; i < (int) shape.verts.size(); i++) {
+            int k = (i + 1) % shape.verts.size();
+            Point p0 = shape.verts[i];
+            Point p1 = shape.verts[k];
+            coverage.add_edge(
+                (to_float(p0.x) + 0.5f) * scale - origin_x, (to_float(p0.y) + 0.5f) * scale - origin_y,
+                (to_float(p1.x) + 0.5f) * scale - origin_x, (to_float(p1.y) + 0.5f) * scale - origin_y
+            );
+        }
+
+        coverage.fill(tile.pixels, TILE_SIZE, shape.color, NON_ZERO, true);
+    }
+}
+
+// Find a tile in the cache, drawing it if it isn't there
+const Tile& get_tile(int zoom, int tx, int ty) {
+    uint64_t key = tile_key(zoom, tx, ty);
+
+    auto it = tile_index.find(key);
+    if(it != tile_index.end()) {
+        // Move it to the front, it's the most recently used
+        tiles.splice(tiles.begin(), tiles, it->second);
+        return *it->second;
+    }
+
+    if(tiles.size() < TILE_CACHE_SIZE) {
+        tiles.emplace_front();
+    } else {
+        // Reuse the least recently used tile
+        tile_index.erase(tile_key(tiles.back().zoom, tiles.back().tx, tiles.back().ty));
+        tiles.splice(tiles.begin(), tiles, std::prev(tiles.end()));
+    }
+
+    Tile& tile = tiles.front();
+    tile.zoom = zoom;
+    tile.tx = tx;
+    tile.ty = ty;
+    draw_tile(tile);
+
+    tile_index[key] = tiles.begin();
+    return tile;
+}
+
+// Floor division, so tiles to the left and above the origin have negative indices
+int tile_floor(int v) {
+    return v >= 0 ? v / TILE_SIZE : -((-v + TILE_SIZE - 1) / TILE_SIZE);
+}
+
+// Copy the visible tiles onto the screen
+// MUST BE USED WHEN THE MUTEX IS LOCKED
+void draw_world(uint32_t pixels[][SCREEN_WIDTH]) {
+    if(world_changed) {
+        // Only the tiles the new shapes land on have to be drawn again
+        for(; shapes_indexed < (int) world.size(); shapes_indexed++) {
+            index_shape(shapes_indexed);
+        }
+        world_changed = false;
+    }
+    view_changed = false;
+
+    const int tx0 = tile_floor(view.x);
+    const int ty0 = tile_floor(view.y);
+    const int tx1 = tile_floor(view.x + SCREEN_WIDTH - 1);
+    const int ty1 = tile_floor(view.y + SCREEN_HEIGHT - 1);
+
+    for(int ty = ty0; ty <= ty1; ty++) {
+        for(int tx = tx0; tx <= tx1; tx++) {
+            const Tile& tile = get_tile(view.zoom, tx, ty);
+
+            // Part of the tile that lands on the screen
+            const int sx = tx * TILE_SIZE - view.x;
+            const int sy = ty * TILE_SIZE - view.y;
+            const int x0 = std::max(sx, 0);
+            const int x1 = std::min(sx + TILE_SIZE, SCREEN_WIDTH);
+            const int y0 = std::max(sy, 0);
+            const int y1 = std::min(sy + TILE_SIZE, SCREEN_HEIGHT);
+
+            for(int y = y0; y < y1; y++) {
+                std::copy(
+                    &tile.pixels[(y - sy) * TILE_SIZE + (x0 - sx)],
+                    &tile.pixels[(y - sy) * TILE_SIZE + (x1 - sx)],
+                    &pixels[y][x0]
+                );
+            }
+        }
+    }
+}
+
+
+// Helper function to make sure we're only writing to pixels on the screen. With a mask the
+// pixel is only written if nothing has covered it yet.
+// MUST BE USED WHEN THE MUTEX IS LOCKED
+void plot_point(uint32_t pixels[][SCREEN_WIDTH], int x, int y, uint32_t color, CoverageMask* mask) {
+    if((y < 0 || y >= SCREEN_HEIGHT) || (x < 0 || x >= SCREEN_WIDTH))
+        return;
+
+    if(mask != NULL) {
+        uint64_t& word = mask->bits[y][x / 64];
+        uint64_t bit = (uint64_t) 1 << (x % 64);
+
+        if(word & bit)
+            return;
+
+        word |= bit;
+    }
+
+    pixels[y][x] = color;
+}
+
+// Fill the pixels from x0 to x1 (inclusive) on a row, they must be on the screen. With a mask
+// only the pixels nothing has covered yet are written, 64 pixels at a time.
+// MUST BE USED WHEN THE MUTEX IS LOCKED
+void fill_span(uint32_t pixels[][SCREEN_WIDTH], int y, int x0, int x1, uint32_t color, CoverageMask* mask) {
+    if(mask == NULL) {
+        std::fill(&pixels[y][x0], &pixels[y][x1] + 1, color);
+        return;
+    }
+
+    for(int w = x0 / 64; w <= x1 / 64; w++) {
+        const int start = std::max(x0, w * 64);
+        const int end = std::min(x1, w * 64 + 63);
+
+        // Bits for the part of the span in this word that hasn't been covered
+        uint64_t span = (~(uint64_t) 0 >> (63 - (end - start))) << (start % 64);
+        uint64_t todo = span & ~mask->bits[y][w];
+
+        if(todo == 0)
+            continue;
+
+        mask->bits[y][w] |= todo;
+
+        if(todo == span) {
+            std::fill(&pixels[y][start], &pixels[y][end] + 1, color);
+            continue;
+        }
+
+        // Write each run of uncovered pixels in one go
+        while(todo != 0) {
+            const int first = lowest_bit(todo);
+            const uint64_t rest = ~(todo >> first);
+            const int length = rest == 0 ? 64 - first : lowest_bit(rest);
+
+            std::fill(&pixels[y][w * 64 + first], &pixels[y][w * 64 + first] + length, color);
+
+            // Adding the lowest bit of the run carries through it and clears it
+            todo &= todo + (todo & (~todo + 1));
+        }
+    }
+}
+
+// Index of the lowest set bit, v must not be 0
+int lowest_bit(uint64_t v) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, v);
+    return (int) index;
+#else
+    return __builtin_ctzll(v);
+#endif
 }
 
 // Helper function for drawing a line
 // Bresenham's Algorithm
 // https://rosettacode.org/wiki/Bitmap/Bresenham%27s_line_algorithm#C.2B.2B
 // MUST BE USED WHEN THE MUTEX IS LOCKED
-void draw_line(uint32_t pixels[][SCREEN_WIDTH], Point p0, Point p1, uint32_t color) {
-    const bool steep = abs(p1.y - p0.y) > abs(p1.x - p0.x);
+void draw_line(uint32_t pixels[][SCREEN_WIDTH], Point p0, Point p1, uint32_t color, CoverageMask* mask) {
+    const bool steep = llabs((int64_t) p1.y - p0.y) > llabs((int64_t) p1.x - p0.x);
     if(steep) {
         std::swap(p0.x, p0.y);
         std::swap(p1.x, p1.y);
@@ -500,38 +2379,52 @@ void draw_line(uint32_t pixels[][SCREEN_WIDTH], Point p0, Point p1, uint32_t col
         std::swap(p0.y, p1.y);
     }
 
-    const float dx = (float) p1.x - p0.x;
-    const float dy = (float) abs(p1.y - p0.y);
-    
-    float error = dx / 2.0f;
+    const int x_start = fixed_round(p0.x);
+    const int x_end = fixed_round(p1.x);
+    if(x_start >= x_end)
+        return;
+
+    // Bresenham on the fixed point line, all in integers. The row is counted in the direction
+    // of ystep and error is how far the line is from the top of the next row, scaled by dx.
+    const int64_t dx = (int64_t) p1.x - p0.x;
+    const int64_t dy = llabs((int64_t) p1.y - p0.y);
     const int ystep = (p0.y < p1.y) ? 1 : -1;
-    
-    int y = p0.y;
+    const int64_t row_height = FIXED_ONE * dx;
 
-    for(int x = p0.x; x < p1.x; x++) {
+    // Where the line is at the centre of the first column, halfway rounds towards p0
+    const int64_t start = (int64_t) ystep * p0.y * dx + ((int64_t) to_fixed(x_start) - p0.x) * dy - FIXED_HALF * dx;
+    int64_t row = start >= 0 ? (start + row_height - 1) / row_height : -(-start / row_height);
+    int64_t error = row * row_height - start;
+
+    for(int x = x_start; x < x_end; x++) {
+        const int y = (int) row * ystep;
         if(steep) {
-            plot_point(pixels, y, x, color);
+            plot_point(pixels, y, x, color, mask);
         } else {
-            plot_point(pixels, x, y, color);
+            plot_point(pixels, x, y, color, mask);
         }
 
-        error -= dy;
+        error -= FIXED_ONE * dy;
         if(error < 0) {
-            y += ystep;
-            error += dx;
+            row++;
+            error += row_height;
         }
     }
 }
 
 // Helper function to draw a polygon from supplied vertic`es
 // MUST BE USED WHEN THE MUTEX IS LOCKED
-void draw_polygon(uint32_t pixels[][SCREEN_WIDTH], const std::vector<Point>& verts, uint32_t color) {
+void draw_polygon(uint32_t pixels[][SCREEN_WIDTH], const Polygon& verts, uint32_t color, CoverageMask* mask) {
+    // Clipping can leave nothing behind
+    if(verts.empty())
+        return;
+
     for(int i = 0; i < (int) verts.size() - 1; i++) {
-        draw_line(pixels, verts[i], verts[i + 1], color);
+        draw_line(pixels, verts[i], verts[i + 1], color, mask);
     }
 
     // Connect the last vertex with the first
-    draw_line(pixels, verts[verts.size() - 1], verts[0], color);
+    draw_line(pixels, verts[verts.size() - 1], verts[0], color, mask);
 }
 
 // Loop through all the pixels on the screen and set them to black
@@ -545,8 +2438,8 @@ void clear(uint32_t pixels[][SCREEN_WIDTH]) {
 }
 
 // Translate each vertex in a polygon by a point and return a new set of points (non-destructive)
-std::vector<Point> translate_polygon(const std::vector<Point>& verts, Point p) {
-    std::vector<Point> new_verts(verts);
+Polygon translate_polygon(const Polygon& verts, Point p) {
+    Polygon new_verts(verts, verts.get_allocator());
 
     for(auto& vert : new_verts) {
         vert.x += p.x;
@@ -554,4 +2447,101 @@ std::vector<Point> translate_polygon(const std::vector<Point>& verts, Point p) {
     }
 
     return new_verts;
-}
\ No newline at end of file
+}
+
+//
+// Fixed point
+//
+
+// v must be within COORD_MAX, anything larger doesn't fit in 24.8 fixed point
+fixed to_fixed(int v) {
+    return v * FIXED_ONE;
+}
+
+// A point that was entered, clamped to the coordinates that fit in fixed point
+Point input_point(int x, int y) {
+    return Point {
+        to_fixed(std::min(std::max(x, -COORD_MAX), COORD_MAX)),
+        to_fixed(std::min(std::max(y, -COORD_MAX), COORD_MAX))
+    };
+}
+
+// Nearest whole pixel, halfway rounds up
+int fixed_round(fixed v) {
+    return (v + FIXED_HALF) >> FIXED_SHIFT;
+}
+
+float to_float(fixed v) {
+    return v / (float) FIXED_ONE;
+}
+
+// a + (b - a) * num / den rounded to the nearest unit. num and den can be products of two
+// coordinates, they lose their low bits if the product with b - a would not fit in 64 bits.
+fixed fixed_lerp(fixed a, fixed b, int64_t num, int64_t den) {
+    if(den == 0)
+        return a;
+
+    if(den < 0) {
+        num = -num;
+        den = -den;
+    }
+
+    const int64_t d = (int64_t) b - a;
+    while(d != 0 && llabs(num) > INT64_MAX / 2 / llabs(d)) {
+        num /= 2;
+        den /= 2;
+    }
+
+    if(den == 0)
+        return b;
+
+    const int64_t t = d * num;
+    return a + (fixed) ((t >= 0 ? t + den / 2 : t - den / 2) / den);
+}
+
+//
+// Arena
+//
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+Arena::~Arena() {
+    for(auto block : blocks) {
+        delete[] block;
+    }
+}
+
+void* Arena::allocate(size_t bytes, size_t align) {
+    char* p = (char*) (((uintptr_t) head + align - 1) & ~(uintptr_t) (align - 1));
+
+    if(head == NULL || p + bytes > end) {
+        // Out of room, start a new block at least twice as big as the last one
+        size_t size = std::max({ (size_t) ARENA_BLOCK_SIZE, capacity, bytes + align });
+        char* block = new char[size];
+        blocks.push_back(block);
+        capacity += size;
+
+        head = block;
+        end = block + size;
+        p = (char*) (((uintptr_t) head + align - 1) & ~(uintptr_t) (align - 1));
+    }
+
+    head = p + bytes;
+    return p;
+}
+
+void Arena::reset() {
+    if(blocks.size() > 1) {
+        // The last command needed more than one block, replace them with one block that fits
+        // everything so commands like it don't allocate again.
+        for(auto block : blocks) {
+            delete[] block;
+        }
+        blocks.clear();
+        blocks.push_back(new char[capacity]);
+    }
+
+    if(!blocks.empty()) {
+        head = blocks[0];
+        end = blocks[0] + capacity;
+    }
+}